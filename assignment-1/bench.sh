@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Sweep of the sort over the input shape and the scheduler settings:
+# distribution, file count, numbers per file, coroutine count and
+# target latency. Prints one CSV line per run: wall time, the sort
+# and merge phases, context switches of all the coroutines and peak
+# RSS. The inputs are made by bench_gen with fixed seeds, so runs on
+# different commits compare.
+#
+# $> make bench > bench.csv
+# $> DISTS=zipf FILES="1 8" COUNTS=1000000 ./bench.sh
+#
+# The generated files are kept in BENCH_DIR between the runs.
+
+set -e
+
+DISTS=${DISTS:-"uniform sorted few zipf"}
+FILES=${FILES:-"1 4 16"}
+COUNTS=${COUNTS:-"100000 1000000"}
+COROS=${COROS:-"1 4 16"}
+LATENCIES=${LATENCIES:-"100 10000"}
+BENCH_DIR=${BENCH_DIR:-/tmp/sort_bench}
+
+bin=$(cd "$(dirname "$0")" && pwd)
+mkdir -p "$BENCH_DIR"
+cd "$BENCH_DIR"
+
+echo "dist,files,count,coroutines,latency_us,wall_s,sort_s,merge_s,switches,peak_rss_kb"
+for dist in $DISTS; do
+	for count in $COUNTS; do
+		for files in $FILES; do
+			names=""
+			i=1
+			while [ $i -le $files ]; do
+				name=$dist-$count-$i.txt
+				if [ ! -f $name ]; then
+					"$bin/bench_gen" -f $name.tmp -c $count \
+						-d $dist -s $i
+					mv $name.tmp $name
+				fi
+				names="$names $name"
+				i=$((i + 1))
+			done
+			for coros in $COROS; do
+				for latency in $LATENCIES; do
+					"$bin/a.out" $latency $coros $names | awk \
+						-v prefix="$dist,$files,$count,$coros,$latency" '
+						/^coroutine [0-9]+ finished:/ { switches += $4 }
+						/^phases:/ { sort = $3; merge = $6 }
+						/^peak RSS/ { rss = $3 }
+						/^Total time taken is/ { wall = $5 }
+						END {
+							printf "%s,%s,%s,%s,%d,%s\n", prefix,
+							       wall, sort, merge, switches, rss
+						}'
+				done
+			done
+		done
+	done
+done
+rm -f output.txt
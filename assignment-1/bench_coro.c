@@ -0,0 +1,81 @@
+/*
+ * Microbenchmark of libcoro: cost of a coroutine creation and of
+ * a context switch in nanoseconds.
+ *
+ * $> make bench_coro
+ * $> ./bench_coro [coro_count] [switch_count] [stack_size]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+
+static long long
+now_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (long long) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static int
+empty_func(void *arg)
+{
+	(void) arg;
+	return 0;
+}
+
+static int
+yield_func(void *arg)
+{
+	long long count = *(long long *) arg;
+	for (long long i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int coro_count = argc > 1 ? atoi(argv[1]) : 10000;
+	long long switch_count = argc > 2 ? atoll(argv[2]) : 1000000;
+	size_t stack_size = argc > 3 ? (size_t) atoll(argv[3]) :
+			    CORO_STACK_SIZE_DEFAULT;
+
+	coro_sched_init();
+	printf("backend: %s\n", coro_switch_backend());
+
+	/*
+	 * Creation: new + first run until the finish + delete. The
+	 * second round gets the stacks from the cache.
+	 */
+	struct coro *c;
+	for (int round = 0; round < 2; ++round) {
+		long long t = now_ns();
+		for (int i = 0; i < coro_count; ++i)
+			coro_new_ex(empty_func, NULL, stack_size);
+		long long create = now_ns() - t;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		long long total = now_ns() - t;
+		printf("%s create: %.1f ns/coro, create+run+delete: "
+		       "%.1f ns/coro\n", round == 0 ? "cold" : "warm",
+		       (double) create / coro_count,
+		       (double) total / coro_count);
+	}
+
+	/* Switch: two coroutines ping-pong via the scheduler. */
+	long long per_coro = switch_count / 2;
+	coro_new_ex(yield_func, &per_coro, stack_size);
+	coro_new_ex(yield_func, &per_coro, stack_size);
+	long long t = now_ns();
+	while ((c = coro_sched_wait()) != NULL) {
+		printf("stack: %zu of %zu bytes used\n", coro_stack_usage(c),
+		       coro_stack_size(c));
+		coro_delete(c);
+	}
+	t = now_ns() - t;
+	printf("switch: %.1f ns/switch over %lld yields\n",
+	       (double) t / (per_coro * 2), per_coro * 2);
+	return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * Test data generator, a fast and reproducible generator.py with
+ * more distributions. The same seed gives the same file.
+ *
+ * uniform - random in [0, max], like generator.py;
+ * sorted, reversed - [0, max] spread over the count;
+ * few - random of @a unique values spread over [0, max];
+ * zipf - value k - 1 with probability ~ 1 / k^exponent, k in
+ *        [1, max + 1], so the small values repeat a lot;
+ * organ - sorted first half and reversed second half.
+ *
+ * $> make bench_gen
+ * $> ./bench_gen -f file -c count [-m max] [-d distribution]
+ *    [-s seed] [-u unique] [-e exponent]
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "output.h"
+
+enum {
+	BUF_SIZE = 16 * 1024,
+};
+
+enum dist {
+	DIST_UNIFORM,
+	DIST_SORTED,
+	DIST_REVERSED,
+	DIST_FEW,
+	DIST_ZIPF,
+	DIST_ORGAN,
+	dist_MAX,
+};
+
+static const char *dist_names[] = {
+	"uniform", "sorted", "reversed", "few", "zipf", "organ",
+};
+
+static uint64_t rng_state;
+
+/** splitmix64, small and good enough for test data. */
+static uint64_t
+rng_next(void)
+{
+	uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/** Uniform in [0, bound). */
+static uint64_t
+rng_below(uint64_t bound)
+{
+	return (uint64_t) ((unsigned __int128) rng_next() * bound >> 64);
+}
+
+/** Uniform in [0, 1). */
+static double
+rng_double(void)
+{
+	return (rng_next() >> 11) * 0x1.0p-53;
+}
+
+/**
+ * Zipf sampler by rejection-inversion, W. Hormann, G. Derflinger,
+ * "Rejection-inversion to generate variates from monotone discrete
+ * distributions". O(1) per number for any count of values.
+ */
+struct zipf {
+	double exponent;
+	double n;
+	double h_x1;
+	double h_n;
+	double s;
+};
+
+/** log1p(x) / x, precise near 0. */
+static double
+zipf_helper1(double x)
+{
+	if (fabs(x) > 1e-8)
+		return log1p(x) / x;
+	return 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+/** expm1(x) / x, precise near 0. */
+static double
+zipf_helper2(double x)
+{
+	if (fabs(x) > 1e-8)
+		return expm1(x) / x;
+	return 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+static double
+zipf_h(const struct zipf *z, double x)
+{
+	return exp(-z->exponent * log(x));
+}
+
+static double
+zipf_h_integral(const struct zipf *z, double x)
+{
+	double log_x = log(x);
+	return zipf_helper2((1 - z->exponent) * log_x) * log_x;
+}
+
+static double
+zipf_h_integral_inverse(const struct zipf *z, double x)
+{
+	double t = x * (1 - z->exponent);
+	if (t < -1)
+		t = -1;
+	return exp(zipf_helper1(t) * x);
+}
+
+static void
+zipf_create(struct zipf *z, uint64_t n, double exponent)
+{
+	z->exponent = exponent;
+	z->n = (double) n;
+	z->h_x1 = zipf_h_integral(z, 1.5) - 1;
+	z->h_n = zipf_h_integral(z, z->n + 0.5);
+	z->s = 2 - zipf_h_integral_inverse(z, zipf_h_integral(z, 2.5) -
+					   zipf_h(z, 2));
+}
+
+/** A rank in [1, n]. */
+static uint64_t
+zipf_next(const struct zipf *z)
+{
+	while (true) {
+		double u = z->h_n + rng_double() * (z->h_x1 - z->h_n);
+		double x = zipf_h_integral_inverse(z, u);
+		double k = floor(x + 0.5);
+		if (k < 1)
+			k = 1;
+		else if (k > z->n)
+			k = z->n;
+		if (k - x <= z->s ||
+		    u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k))
+			return (uint64_t) k;
+	}
+}
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s -f file -c count [-m max] "
+	       "[-d uniform|sorted|reversed|few|zipf|organ] [-s seed] "
+	       "[-u unique] [-e exponent]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *name = NULL;
+	uint64_t count = 0;
+	bool is_count = false;
+	uint64_t max = INT32_MAX;
+	enum dist dist = DIST_UNIFORM;
+	uint64_t seed = 1;
+	uint64_t unique = 16;
+	double exponent = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:c:m:d:s:u:e:")) != -1) {
+		switch (opt) {
+		case 'f':
+			name = optarg;
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 10);
+			is_count = true;
+			break;
+		case 'm':
+			max = strtoull(optarg, NULL, 10);
+			if (max > INT32_MAX)
+				usage(argv[0]);
+			break;
+		case 'd':
+			for (dist = 0; dist < dist_MAX; ++dist) {
+				if (strcmp(optarg, dist_names[dist]) == 0)
+					break;
+			}
+			if (dist == dist_MAX)
+				usage(argv[0]);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'u':
+			unique = strtoull(optarg, NULL, 10);
+			if (unique == 0)
+				usage(argv[0]);
+			break;
+		case 'e':
+			exponent = strtod(optarg, NULL);
+			if (! (exponent > 0))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (name == NULL || ! is_count)
+		usage(argv[0]);
+	rng_state = seed;
+	struct zipf zipf;
+	zipf_create(&zipf, max + 1, exponent);
+
+	struct output out;
+	if (output_open(&out, name, OUTPUT_TEXT) != 0) {
+		perror(name);
+		return 1;
+	}
+	int *buf = malloc(BUF_SIZE * sizeof(int));
+	if (buf == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	uint64_t half = (count + 1) / 2;
+	for (uint64_t i = 0; i < count; i += BUF_SIZE) {
+		size_t n = count - i < BUF_SIZE ? count - i : BUF_SIZE;
+		for (size_t j = 0; j < n; ++j) {
+			uint64_t k = i + j;
+			uint64_t v;
+			switch (dist) {
+			case DIST_SORTED:
+				v = (unsigned __int128) k * max / count;
+				break;
+			case DIST_REVERSED:
+				v = (unsigned __int128) (count - 1 - k) * max / count;
+				break;
+			case DIST_FEW:
+				v = unique > 1 ? (unsigned __int128)
+					rng_below(unique) * max / (unique - 1) : 0;
+				break;
+			case DIST_ZIPF:
+				v = zipf_next(&zipf) - 1;
+				break;
+			case DIST_ORGAN:
+				if (k >= half)
+					k = count - 1 - k;
+				v = (unsigned __int128) k * max / half;
+				break;
+			default:
+				v = rng_below(max + 1);
+				break;
+			}
+			buf[j] = (int) v;
+		}
+		if (output_ints(&out, buf, n) != 0) {
+			perror(name);
+			return 1;
+		}
+	}
+	free(buf);
+	if (output_close(&out) != 0) {
+		perror(name);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * K-way merge of sorted runs: the tree of losers against the former
+ * linear scan of all the cursors for the minimum. The total count
+ * of numbers stays the same, while K goes from 2 to max_k, 2 times
+ * up each step. The linear scan is O(N * K), so it is run only up
+ * to scan_max_k.
+ *
+ * $> make bench_merge
+ * $> ./bench_merge [total_count] [max_k] [scan_max_k]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "merge.h"
+#include "sort.h"
+
+enum {
+	BLOCK_SIZE = 16 * 1024,
+};
+
+static long long
+now_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (long long) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static void
+srcs_init(struct merge_src *srcs, const int *data, size_t total, int k)
+{
+	for (int i = 0; i < k; ++i) {
+		srcs[i].pos = data + total * i / k;
+		srcs[i].end = data + total * (i + 1) / k;
+		srcs[i].refill = NULL;
+	}
+}
+
+static void
+merge_tree_run(struct merge_src *srcs, int k, int *out)
+{
+	struct merge_tree *tree = merge_tree_new(srcs, k);
+	size_t n;
+	while ((n = merge_tree_next(tree, out, BLOCK_SIZE)) > 0)
+		out += n;
+	merge_tree_delete(tree);
+}
+
+static void
+merge_scan_run(struct merge_src *srcs, int k, int *out)
+{
+	int cnt = k;
+	while (cnt > 0) {
+		int min_ind = 0;
+		for (int i = 1; i < cnt; ++i) {
+			if (*srcs[i].pos < *srcs[min_ind].pos)
+				min_ind = i;
+		}
+		*out++ = *srcs[min_ind].pos++;
+		if (srcs[min_ind].pos == srcs[min_ind].end)
+			srcs[min_ind] = srcs[--cnt];
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t total = argc > 1 ? (size_t) atoll(argv[1]) : 16 * 1024 * 1024;
+	int max_k = argc > 2 ? atoi(argv[2]) : 4096;
+	int scan_max_k = argc > 3 ? atoi(argv[3]) : 64;
+	int *data = malloc(total * sizeof(int));
+	int *sorted = malloc(total * sizeof(int));
+	int *out = malloc(total * sizeof(int));
+	struct merge_src *srcs = malloc(max_k * sizeof(*srcs));
+	srand(1);
+	for (size_t i = 0; i < total; ++i)
+		data[i] = rand();
+	memcpy(sorted, data, total * sizeof(int));
+	sort_radix(sorted, total);
+
+	printf("%6s %10s %14s\n", "k", "merge", "ns/element");
+	for (int k = 2; k <= max_k; k *= 2) {
+		for (size_t i = 0; i < (size_t) k; ++i) {
+			size_t begin = total * i / k;
+			size_t end = total * (i + 1) / k;
+			sort_radix(data + begin, end - begin);
+		}
+		struct {
+			const char *name;
+			void (*merge)(struct merge_src *, int, int *);
+			int max_k;
+		} merges[] = {
+			{"tree", merge_tree_run, max_k},
+			{"scan", merge_scan_run, scan_max_k},
+		};
+		for (int m = 0; m < 2; ++m) {
+			if (k > merges[m].max_k)
+				continue;
+			srcs_init(srcs, data, total, k);
+			long long t = now_ns();
+			merges[m].merge(srcs, k, out);
+			t = now_ns() - t;
+			if (memcmp(out, sorted, total * sizeof(int)) != 0) {
+				printf("%s failed with k = %d\n", merges[m].name,
+				       k);
+				return 1;
+			}
+			printf("%6d %10s %14.1f\n", k, merges[m].name,
+			       (double) t / total);
+		}
+	}
+	free(srcs);
+	free(out);
+	free(sorted);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Output throughput in MB/s of text: fprintf("%d ") against the
+ * output writer in text, binary and packed modes, on sorted numbers
+ * like the merge writes. The file goes to the
+ * page cache, so mostly the formatting is measured. MB/s are
+ * counted by the text size for all of them, so they compare
+ * as numbers per second.
+ *
+ * $> make bench_output
+ * $> ./bench_output [number_count] [repeat_count]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "output.h"
+
+enum {
+	BLOCK_SIZE = 16 * 1024,
+};
+
+static const char *file_name = "/tmp/bench_output.txt";
+
+static long long
+now_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (long long) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static long
+write_fprintf(const int *arr, size_t count)
+{
+	FILE *f = fopen(file_name, "w");
+	for (size_t i = 0; i < count; ++i)
+		fprintf(f, "%d ", arr[i]);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+static long
+write_output(const int *arr, size_t count, enum output_format format)
+{
+	struct output out;
+	if (output_open(&out, file_name, format) != 0)
+		return -1;
+	/* By blocks, like the merge gives them. */
+	for (size_t i = 0; i < count; i += BLOCK_SIZE) {
+		size_t n = count - i < BLOCK_SIZE ? count - i : BLOCK_SIZE;
+		output_ints(&out, arr + i, n);
+	}
+	output_close(&out);
+	FILE *f = fopen(file_name, "r");
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+static long
+write_text(const int *arr, size_t count)
+{
+	return write_output(arr, count, OUTPUT_TEXT);
+}
+
+static long
+write_binary(const int *arr, size_t count)
+{
+	return write_output(arr, count, OUTPUT_BINARY);
+}
+
+static long
+write_packed(const int *arr, size_t count)
+{
+	return write_output(arr, count, OUTPUT_PACKED);
+}
+
+static int
+int_cmp(const void *a, const void *b)
+{
+	int x = *(const int *) a;
+	int y = *(const int *) b;
+	return (x > y) - (x < y);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t count = argc > 1 ? (size_t) atoll(argv[1]) : 10000000;
+	int repeat_count = argc > 2 ? atoi(argv[2]) : 3;
+	int *arr = malloc(count * sizeof(int));
+	srand(1);
+	for (size_t i = 0; i < count; ++i)
+		arr[i] = rand() - RAND_MAX / 4;
+	qsort(arr, count, sizeof(int), int_cmp);
+	struct {
+		const char *name;
+		long (*write)(const int *, size_t);
+	} writers[] = {
+		{"fprintf", write_fprintf},
+		{"text", write_text},
+		{"binary", write_binary},
+		{"packed", write_packed},
+	};
+	int writer_count = sizeof(writers) / sizeof(writers[0]);
+	long text_size = 0;
+	printf("%10s %12s %10s\n", "writer", "file bytes", "MB/s");
+	for (int w = 0; w < writer_count; ++w) {
+		long long best = 0;
+		long size = 0;
+		for (int r = 0; r < repeat_count; ++r) {
+			long long t = now_ns();
+			size = writers[w].write(arr, count);
+			t = now_ns() - t;
+			if (best == 0 || t < best)
+				best = t;
+		}
+		if (w == 0)
+			text_size = size;
+		else if (w == 1 && size != text_size) {
+			printf("text size %ld differs from fprintf %ld\n",
+			       size, text_size);
+			return 1;
+		}
+		printf("%10s %12ld %10.1f\n", writers[w].name, size,
+		       text_size * 1e3 / best);
+	}
+	unlink(file_name);
+	free(arr);
+	return 0;
+}
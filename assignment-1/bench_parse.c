@@ -0,0 +1,139 @@
+/*
+ * Input parsing throughput in MB/s: the original two fscanf() passes
+ * (count, rewind, fill), read() with strtol(), and mmap() with the
+ * parse_ints() scanner. A file of random numbers is generated once
+ * and stays in the page cache, so only the parsing is measured.
+ *
+ * $> make bench_parse
+ * $> ./bench_parse [number_count] [repeat_count]
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "parse.h"
+
+static long long
+now_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (long long) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static int *
+parse_fscanf(const char *name, size_t *count)
+{
+	FILE *f = fopen(name, "r");
+	int num;
+	size_t cnt = 0;
+	while (fscanf(f, "%d", &num) == 1)
+		++cnt;
+	rewind(f);
+	int *arr = malloc(cnt * sizeof(int) + 1);
+	for (size_t i = 0; i < cnt; ++i)
+		fscanf(f, "%d", &arr[i]);
+	fclose(f);
+	*count = cnt;
+	return arr;
+}
+
+static int *
+parse_strtol(const char *name, size_t *count)
+{
+	int fd = open(name, O_RDONLY);
+	off_t size = lseek(fd, 0, SEEK_END);
+	lseek(fd, 0, SEEK_SET);
+	char *buf = malloc(size + 1);
+	for (off_t done = 0; done < size;)
+		done += read(fd, buf + done, size - done);
+	buf[size] = '\0';
+	close(fd);
+	size_t capacity = 1024;
+	size_t cnt = 0;
+	int *arr = malloc(capacity * sizeof(int));
+	char *p = buf;
+	char *end;
+	while (true) {
+		long num = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (cnt == capacity) {
+			capacity *= 2;
+			arr = realloc(arr, capacity * sizeof(int));
+		}
+		arr[cnt++] = (int) num;
+		p = end;
+	}
+	free(buf);
+	*count = cnt;
+	return arr;
+}
+
+static int *
+parse_mmap(const char *name, size_t *count)
+{
+	struct parse_buf buf;
+	if (parse_buf_open(&buf, name) != 0)
+		return NULL;
+	int *arr = parse_ints(buf.data, buf.size, count);
+	parse_buf_close(&buf);
+	return arr;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t number_count = argc > 1 ? (size_t) atoll(argv[1]) : 1000000;
+	int repeat_count = argc > 2 ? atoi(argv[2]) : 5;
+	char name[] = "/tmp/bench_parse_XXXXXX";
+	int fd = mkstemp(name);
+	FILE *f = fdopen(fd, "w");
+	int *expected = malloc(number_count * sizeof(int));
+	srand(1);
+	for (size_t i = 0; i < number_count; ++i) {
+		/* Negatives too, the generator makes none of them. */
+		expected[i] = rand() - RAND_MAX / 4;
+		fprintf(f, "%d ", expected[i]);
+	}
+	long file_size = ftell(f);
+	fclose(f);
+
+	struct {
+		const char *name;
+		int *(*parse)(const char *, size_t *);
+	} parsers[] = {
+		{"fscanf x2", parse_fscanf},
+		{"strtol", parse_strtol},
+		{"mmap", parse_mmap},
+	};
+	int parser_count = sizeof(parsers) / sizeof(parsers[0]);
+	printf("%d numbers, %.1f MB\n", (int) number_count, file_size / 1e6);
+	printf("%10s %10s\n", "parser", "MB/s");
+	for (int p = 0; p < parser_count; ++p) {
+		long long best = 0;
+		for (int r = 0; r < repeat_count; ++r) {
+			size_t count;
+			long long t = now_ns();
+			int *arr = parsers[p].parse(name, &count);
+			t = now_ns() - t;
+			if (count != number_count || memcmp(arr, expected,
+			    count * sizeof(int)) != 0) {
+				printf("%s parsed wrong numbers\n",
+				       parsers[p].name);
+				unlink(name);
+				return 1;
+			}
+			free(arr);
+			if (best == 0 || t < best)
+				best = t;
+		}
+		printf("%10s %10.1f\n", parsers[p].name,
+		       file_size * 1e3 / best);
+	}
+	unlink(name);
+	free(expected);
+	return 0;
+}
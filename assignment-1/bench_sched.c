@@ -0,0 +1,64 @@
+/*
+ * Scheduler scalability benchmark: per-switch and per-finish cost
+ * of libcoro with 10 to 100k coroutines. Both should stay flat.
+ *
+ * $> make bench_sched
+ * $> ./bench_sched [total_switches] [thread_count]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+
+static long long
+now_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (long long) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static int
+yield_func(void *arg)
+{
+	long long count = *(long long *) arg;
+	for (long long i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	long long total = argc > 1 ? atoll(argv[1]) : 4000000;
+	int thread_count = argc > 2 ? atoi(argv[2]) : 1;
+	coro_sched_init_mt(thread_count);
+	printf("%10s %12s %14s %14s\n", "coroutines", "yields",
+	       "ns/switch", "ns/finish");
+	for (int count = 10; count <= 100000; count *= 10) {
+		long long per_coro = total / count;
+		if (per_coro == 0)
+			per_coro = 1;
+		for (int i = 0; i < count; ++i)
+			coro_new_ex(yield_func, &per_coro, 16 * 1024);
+		long long t = now_ns();
+		struct coro *c;
+		long long reap = 0;
+		int finished = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			long long r = now_ns();
+			coro_delete(c);
+			++finished;
+			/* Time from the first finish till the last. */
+			if (finished == 1)
+				reap = r;
+		}
+		long long end = now_ns();
+		double switch_ns = (double) (reap - t) / (per_coro * count);
+		double finish_ns = (double) (end - reap) / count;
+		printf("%10d %12lld %14.1f %14.1f\n", count, per_coro * count,
+		       switch_ns, finish_ns);
+	}
+	coro_sched_destroy();
+	return 0;
+}
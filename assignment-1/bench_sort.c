@@ -0,0 +1,207 @@
+/*
+ * Sort kernels on typical input patterns: pdqsort with and without
+ * the AVX2 kernels, radix sort, counting sort, natural runs merge and
+ * the automatic choice of them against libc qsort() and the former
+ * Lomuto quicksort with the last element pivot. The random patterns
+ * are what generator.py makes by default and with -m 10000. Lomuto is quadratic on sorted and all-equal
+ * inputs, so it is run only on small arrays. The array size goes
+ * from min_count to max_count, 10 times up each step.
+ *
+ * $> make bench_sort
+ * $> ./bench_sort [min_count] [max_count] [lomuto_max_count]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sort.h"
+
+static long long
+now_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (long long) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static void
+lomuto_sort(int *arr, int low, int high)
+{
+	if (low >= high)
+		return;
+	int pivot = arr[high];
+	int i = low - 1;
+	for (int j = low; j < high; ++j) {
+		if (arr[j] <= pivot) {
+			++i;
+			int t = arr[i];
+			arr[i] = arr[j];
+			arr[j] = t;
+		}
+	}
+	int t = arr[i + 1];
+	arr[i + 1] = arr[high];
+	arr[high] = t;
+	lomuto_sort(arr, low, i);
+	lomuto_sort(arr, i + 2, high);
+}
+
+static void
+lomuto_run(int *arr, size_t count)
+{
+	lomuto_sort(arr, 0, (int) count - 1);
+}
+
+static int
+int_cmp(const void *a, const void *b)
+{
+	int x = *(const int *) a;
+	int y = *(const int *) b;
+	return (x > y) - (x < y);
+}
+
+static void
+pdq_scalar_run(int *arr, size_t count)
+{
+	sort_set_simd(false);
+	sort_pdq(arr, count);
+	sort_set_simd(true);
+}
+
+static void
+auto_run(int *arr, size_t count)
+{
+	sort_ints(arr, count, SORT_AUTO);
+}
+
+static void
+counting_run(int *arr, size_t count)
+{
+	sort_ints(arr, count, SORT_COUNTING);
+}
+
+static void
+runs_run(int *arr, size_t count)
+{
+	sort_ints(arr, count, SORT_RUNS);
+}
+
+static void
+qsort_run(int *arr, size_t count)
+{
+	qsort(arr, count, sizeof(int), int_cmp);
+}
+
+enum pattern {
+	PATTERN_SORTED,
+	PATTERN_REVERSED,
+	/** Reversed with each value twice: 5 5 4 4 3 3 ... */
+	PATTERN_REVERSED_PAIRS,
+	PATTERN_EQUAL,
+	/** Sorted blocks of 1000 elements in random order. */
+	PATTERN_BLOCKS,
+	/** 100 distinct values. */
+	PATTERN_FEW,
+	PATTERN_RANDOM,
+	/** Random in [0, 10000]. */
+	PATTERN_RANGE,
+	PATTERN_COUNT,
+};
+
+static const char *pattern_names[] = {
+	"sorted", "reversed", "rev-pairs", "equal", "blocks", "few", "random",
+	"range",
+};
+
+static void
+fill(int *arr, size_t count, enum pattern pattern)
+{
+	for (size_t i = 0; i < count; ++i) {
+		switch (pattern) {
+		case PATTERN_SORTED:
+			arr[i] = (int) i;
+			break;
+		case PATTERN_REVERSED:
+			arr[i] = (int) (count - i);
+			break;
+		case PATTERN_REVERSED_PAIRS:
+			arr[i] = (int) ((count - i) / 2);
+			break;
+		case PATTERN_EQUAL:
+			arr[i] = 42;
+			break;
+		case PATTERN_BLOCKS:
+			arr[i] = i % 1000 == 0 ? rand() : arr[i - 1] + 1;
+			break;
+		case PATTERN_FEW:
+			arr[i] = rand() % 100 * 1000003;
+			break;
+		case PATTERN_RANGE:
+			arr[i] = rand() % 10001;
+			break;
+		default:
+			arr[i] = rand();
+			break;
+		}
+	}
+}
+
+static int
+is_sorted(const int *arr, size_t count)
+{
+	for (size_t i = 1; i < count; ++i) {
+		if (arr[i - 1] > arr[i])
+			return 0;
+	}
+	return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t min_count = argc > 1 ? (size_t) atoll(argv[1]) : 1000000;
+	size_t max_count = argc > 2 ? (size_t) atoll(argv[2]) : min_count;
+	size_t lomuto_max = argc > 3 ? (size_t) atoll(argv[3]) : 20000;
+	struct {
+		const char *name;
+		void (*sort)(int *, size_t);
+		size_t max_count;
+	} sorts[] = {
+		{"pdq", sort_pdq, max_count},
+		{"pdq-scalar", pdq_scalar_run, max_count},
+		{"radix", sort_radix, max_count},
+		{"counting", counting_run, max_count},
+		{"runs", runs_run, max_count},
+		{"auto", auto_run, max_count},
+		{"qsort", qsort_run, max_count},
+		{"lomuto", lomuto_run, lomuto_max},
+	};
+	int sort_count = sizeof(sorts) / sizeof(sorts[0]);
+	int *arr = malloc(max_count * sizeof(int));
+	printf("%10s %10s %12s %14s %10s\n", "pattern", "sort", "count",
+	       "ns/element", "M/s");
+	for (size_t count = min_count; count <= max_count; count *= 10) {
+		for (int p = 0; p < PATTERN_COUNT; ++p) {
+			for (int s = 0; s < sort_count; ++s) {
+				if (count > sorts[s].max_count)
+					continue;
+				srand(1);
+				fill(arr, count, p);
+				long long t = now_ns();
+				sorts[s].sort(arr, count);
+				t = now_ns() - t;
+				if (! is_sorted(arr, count)) {
+					printf("%s failed on %s input\n",
+					       sorts[s].name, pattern_names[p]);
+					return 1;
+				}
+				printf("%10s %10s %12zu %14.1f %10.1f\n",
+				       pattern_names[p], sorts[s].name, count,
+				       (double) t / count, count * 1e3 / t);
+			}
+		}
+		if (count == 0)
+			break;
+	}
+	free(arr);
+	return 0;
+}
@@ -1,76 +1,1273 @@
+#if defined(__APPLE__) && defined(CORO_SWITCH_UCONTEXT)
+/* Darwin hides the ucontext functions otherwise. */
+#define _XOPEN_SOURCE 600
+#define _DARWIN_C_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <setjmp.h>
-#include <signal.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define CORO_HAVE_EPOLL 1
+#endif
 #include "libcoro.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
-/** Main coroutine structure, its context. */
+/*
+ * Context switch backend. By default the hand-written register
+ * save/restore is used on the platforms it exists for, ucontext
+ * everywhere else. Either can be forced with
+ * -DCORO_SWITCH_ASM / -DCORO_SWITCH_UCONTEXT.
+ */
+#if !defined(CORO_SWITCH_ASM) && !defined(CORO_SWITCH_UCONTEXT)
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CORO_SWITCH_ASM 1
+#else
+#define CORO_SWITCH_UCONTEXT 1
+#endif
+#endif
+
+#if defined(CORO_SWITCH_ASM) && !defined(__x86_64__) && \
+    !defined(__aarch64__)
+#error "CORO_SWITCH_ASM is supported only on x86-64 and aarch64"
+#endif
+
+#ifdef CORO_SWITCH_UCONTEXT
+#include <ucontext.h>
+#endif
+
+/** Saved execution context of a coroutine. */
+struct coro_ctx {
+#ifdef CORO_SWITCH_ASM
+	/**
+	 * Stack pointer. All the callee-saved registers are
+	 * pushed onto the stack itself.
+	 */
+	void *sp;
+#else
+	ucontext_t uc;
+#endif
+};
+
+/**
+ * Coroutine stack. It is a private anonymous mapping, committed
+ * by the kernel lazily page by page as the coroutine goes deeper.
+ * The lowest page is PROT_NONE so as an overflow crashes instead
+ * of silently corrupting the neighbour memory.
+ */
+struct coro_stack {
+	/** Start of the mapping. The guard page is here. */
+	char *map;
+	/** Size of the mapping including the guard page. */
+	size_t map_size;
+	/** Bytes at the top left committed while in the cache. */
+	size_t kept;
+	/** Next stack in the cache free list. */
+	struct coro_stack *next;
+};
+
+enum {
+	/** Number of helper threads doing blocking file I/O. */
+	CORO_IO_THREADS = 4,
+	/**
+	 * Reactor and timers are polled once per that many rounds.
+	 * Must be a power of 2.
+	 */
+	CORO_POLL_PERIOD = 64,
+	/** Max events taken from epoll at once. */
+	CORO_POLL_EVENTS = 64,
+	/** Default target latency of a ready coroutine, ns. */
+	CORO_LATENCY_DEFAULT = 10000000,
+	/** Shortest time slice, so as switches do not eat the CPU. */
+	CORO_SLICE_MIN = 10000,
+};
+
+/**
+ * Main coroutine structure, its context. The fields of a
+ * coroutine being switched to go first, to fit one cache line.
+ */
 struct coro {
+	/** Last remembered coroutine context. */
+	struct coro_ctx ctx;
+	/** Link in a scheduler queue: ready or finished. */
+	struct coro *next;
+	/** Worker which runs or ran the coroutine last time. */
+	struct coro_worker *worker;
+	/** Time the coroutine should be run at, while it is ready. */
+	long long deadline;
+	/** When the coroutine has become ready last time. */
+	long long ready_time;
+	/** Longest time in ns it was ready, but not running. */
+	long long max_latency;
+	/** Suspension state, see enum coro_park_state. */
+	atomic_int park_state;
+	/** True, if the coroutine has finished. */
+	bool is_finished;
+	long long switch_count;
+	/**
+	 * Max time in ns it can stay ready before being run. 0 means
+	 * the runtime default latency.
+	 */
+	long long latency;
+	/** Time spent running, ns. */
+	long long work_time;
+	/** Longest time in ns it was running without a switch. */
+	long long max_slice;
+	long long create_time;
+	long long finish_time;
 	/** A value, returned by func. */
 	int ret;
 	/** Stack, used by the coroutine. */
-	void *stack;
+	struct coro_stack *stack;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
-	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
-	/** True, if the coroutine has finished. */
-	bool is_finished;
-	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
-	struct coro *next, *prev;
 };
 
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
- */
-static struct coro coro_sched;
-/**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
- */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
-/**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * A coroutine going to sleep in coro_suspend() needs a context
+ * switch to become really suspended, while coro_wakeup() can come
+ * from another thread at any moment. A wakeup which comes before
+ * the switch is completed leaves a token, and the coroutine is put
+ * back to the ready queue right after the switch.
+ */
+enum coro_park_state {
+	/** Running or ready, not waiting for a wakeup. */
+	CORO_PARK_NONE = 0,
+	/** Suspended, only coro_wakeup() can make it ready. */
+	CORO_PARK_SUSPENDED,
+	/** Woken up before it managed to suspend. */
+	CORO_PARK_WOKEN,
+};
+
+/**
+ * Intrusive FIFO of coroutines. A coroutine is in at most one
+ * queue at a time, so push and pop are O(1) without allocations.
+ */
+struct coro_queue {
+	struct coro *first;
+	struct coro *last;
+};
+
+/**
+ * Per-thread scheduler. Each thread running coroutines has one,
+ * with its own ready queue. Runnable coroutines of a runtime can
+ * migrate between its workers.
+ */
+struct coro_worker {
+	/**
+	 * Scheduler is a main coroutine of the thread - the thread
+	 * native context. It catches dead ones and, in the main
+	 * thread, returns them to a user.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment on the thread. */
+	struct coro *this_ptr;
+	/**
+	 * Coroutines ready to run, the earliest deadline first. Most
+	 * come with deadlines not earlier than the queue tail and go
+	 * to the FIFO in O(1). The others go to the heap.
+	 */
+	struct coro_queue ready;
+	struct coro **ready_heap;
+	int ready_heap_size;
+	int ready_heap_capacity;
+	/** Length of the ready queue. Read without locks as a hint. */
+	atomic_int ready_count;
+	/** When the current coroutine got the CPU. */
+	long long run_start;
+	/**
+	 * When the current coroutine should give the CPU away. Made
+	 * earlier by arrivals with earlier deadlines.
+	 */
+	atomic_llong slice_end;
+	/** Protects the ready queue if the runtime has many workers. */
+	pthread_mutex_t mutex;
+	/**
+	 * The coroutine switched away from, which should become
+	 * ready or finished. It is published only when its context
+	 * is saved, so no other thread could resume it too early.
+	 */
+	struct coro *pending;
+	/** The pending coroutine is suspended, not ready. */
+	bool is_pending_park;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish. Always true for the non-main workers.
+	 */
+	bool is_sched_waiting;
+	/** Scheduling rounds count, to poll I/O and timers rarely. */
+	unsigned tick;
+	struct coro_runtime *rt;
+	pthread_t thread;
+};
+
+/** A coroutine sleeping in coro_sleep(). Lives on its stack. */
+struct coro_timer {
+	/** CLOCK_MONOTONIC time to wake up at, in nanoseconds. */
+	long long deadline;
+	struct coro *c;
+	/** Position in the timer heap. */
+	int index;
+};
+
+/**
+ * A blocking I/O call done by a helper thread on behalf of a
+ * coroutine. Lives on the coroutine stack.
+ */
+struct coro_io_job {
+	bool is_write;
+	int fd;
+	void *buf;
+	size_t count;
+	ssize_t result;
+	int error;
+	struct coro *c;
+	struct coro_io_job *next;
+};
+
+/**
+ * A group of workers sharing coroutines. The thread which created
+ * it is the first worker. It runs coroutines only inside
+ * coro_sched_wait(), others - all the time.
+ */
+struct coro_runtime {
+	struct coro_worker *workers;
+	int worker_count;
+	/** Protects the finished queue and idle sleeping. */
+	pthread_mutex_t mutex;
+	/** Idle workers sleep on it until there is new work. */
+	pthread_cond_t cond;
+	/** Finished coroutines not yet returned by coro_sched_wait(). */
+	struct coro_queue finished;
+	/** Number of coroutines not yet returned by coro_sched_wait(). */
+	atomic_llong coro_count;
+	/** Number of workers sleeping on the condition. */
+	atomic_int idle_count;
+	/**
+	 * Bumped each time new work appears so as a worker going to
+	 * sleep could notice it has missed something.
+	 */
+	atomic_uint work_seq;
+	atomic_bool is_shutdown;
+	/** Default latency of the coroutines, ns. */
+	atomic_llong latency;
+	/**
+	 * Coroutines woken up by threads not belonging to the
+	 * runtime. Any worker can pick them. Protected by mutex.
+	 */
+	struct coro_queue remote;
+	atomic_int remote_count;
+
+	/** Binary min-heap of sleeping coroutines by deadline. */
+	struct coro_timer **timers;
+	int timer_capacity;
+	atomic_int timer_count;
+	pthread_mutex_t timer_mutex;
+
+	/** True, while a worker polls the reactor. */
+	atomic_bool is_polling;
+	/** Number of coroutines waiting for fd readiness. */
+	atomic_int io_wait_count;
+#ifdef CORO_HAVE_EPOLL
+	int epoll_fd;
+	/** Interrupts a worker sleeping in epoll_wait(). */
+	int event_fd;
+#endif
+
+	/**
+	 * Helper threads doing blocking I/O on regular files, which
+	 * are always "ready" for epoll, but still can block on disk.
+	 * Started on the first need.
+	 */
+	pthread_t io_threads[CORO_IO_THREADS];
+	int io_thread_count;
+	struct coro_io_job *io_first, *io_last;
+	bool is_io_shutdown;
+	pthread_mutex_t io_mutex;
+	pthread_cond_t io_cond;
+};
+
+/** Scheduler of the current thread. */
+static __thread struct coro_worker *coro_worker_ptr = NULL;
+
+#ifdef CORO_SWITCH_ASM
+
+#ifdef __APPLE__
+#define CORO_ASM_SYM(name) "_" #name
+#define CORO_ASM_FUNC(name) \
+	".globl " CORO_ASM_SYM(name) "\n" \
+	".private_extern " CORO_ASM_SYM(name) "\n" \
+	".p2align 4\n" \
+	CORO_ASM_SYM(name) ":\n"
+#define CORO_ASM_END(name) ""
+#else
+#define CORO_ASM_SYM(name) #name
+#define CORO_ASM_FUNC(name) \
+	".globl " CORO_ASM_SYM(name) "\n" \
+	".hidden " CORO_ASM_SYM(name) "\n" \
+	".type " CORO_ASM_SYM(name) ", @function\n" \
+	".p2align 4\n" \
+	CORO_ASM_SYM(name) ":\n"
+#define CORO_ASM_END(name) ".size " #name ", .-" #name "\n"
+#endif
+
+/**
+ * Save the callee-saved registers of the current context onto
+ * its stack, store the stack pointer into @a from_sp and resume
+ * the context whose stack pointer is @a to_sp. Everything else
+ * is already saved by the caller according to the ABI.
+ */
+void
+coro_ctx_switch_asm(void **from_sp, void *to_sp);
+
+#if defined(__x86_64__)
+
+/*
+ * Frame layout from the stack pointer up: MXCSR (4 bytes), x87
+ * control word (4 bytes), r15, r14, r13, r12, rbx, rbp, return
+ * address.
+ */
+enum {
+	CORO_CTX_FRAME_SIZE = 8 * 8,
+	CORO_CTX_FRAME_RET = 7 * 8,
+};
+
+__asm__(
+	".text\n"
+	CORO_ASM_FUNC(coro_ctx_switch_asm)
+	"pushq %rbp\n"
+	"pushq %rbx\n"
+	"pushq %r12\n"
+	"pushq %r13\n"
+	"pushq %r14\n"
+	"pushq %r15\n"
+	"subq $8, %rsp\n"
+	"stmxcsr (%rsp)\n"
+	"fnstcw 4(%rsp)\n"
+	"movq %rsp, (%rdi)\n"
+	"movq %rsi, %rsp\n"
+	"ldmxcsr (%rsp)\n"
+	"fldcw 4(%rsp)\n"
+	"addq $8, %rsp\n"
+	"popq %r15\n"
+	"popq %r14\n"
+	"popq %r13\n"
+	"popq %r12\n"
+	"popq %rbx\n"
+	"popq %rbp\n"
+	"ret\n"
+	CORO_ASM_END(coro_ctx_switch_asm)
+);
+
+#else /* __aarch64__ */
+
+/*
+ * Frame layout from the stack pointer up: x19-x28, x29 (frame
+ * pointer), x30 (link register), d8-d15. x18 is not touched - it
+ * is reserved by some platforms.
+ */
+enum {
+	CORO_CTX_FRAME_SIZE = 20 * 8,
+	CORO_CTX_FRAME_RET = 11 * 8,
+};
+
+__asm__(
+	".text\n"
+	CORO_ASM_FUNC(coro_ctx_switch_asm)
+	"sub sp, sp, #160\n"
+	"stp x19, x20, [sp, #0]\n"
+	"stp x21, x22, [sp, #16]\n"
+	"stp x23, x24, [sp, #32]\n"
+	"stp x25, x26, [sp, #48]\n"
+	"stp x27, x28, [sp, #64]\n"
+	"stp x29, x30, [sp, #80]\n"
+	"stp d8, d9, [sp, #96]\n"
+	"stp d10, d11, [sp, #112]\n"
+	"stp d12, d13, [sp, #128]\n"
+	"stp d14, d15, [sp, #144]\n"
+	"mov x2, sp\n"
+	"str x2, [x0]\n"
+	"mov sp, x1\n"
+	"ldp x19, x20, [sp, #0]\n"
+	"ldp x21, x22, [sp, #16]\n"
+	"ldp x23, x24, [sp, #32]\n"
+	"ldp x25, x26, [sp, #48]\n"
+	"ldp x27, x28, [sp, #64]\n"
+	"ldp x29, x30, [sp, #80]\n"
+	"ldp d8, d9, [sp, #96]\n"
+	"ldp d10, d11, [sp, #112]\n"
+	"ldp d12, d13, [sp, #128]\n"
+	"ldp d14, d15, [sp, #144]\n"
+	"add sp, sp, #160\n"
+	"ret\n"
+	CORO_ASM_END(coro_ctx_switch_asm)
+);
+
+#endif
+
+/**
+ * Prepare @a ctx so as the first switch into it calls @a entry
+ * on top of the given stack. @a entry must never return.
+ */
+static void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	uintptr_t top = ((uintptr_t) stack + stack_size) & ~(uintptr_t) 15;
+#if defined(__x86_64__)
+	/*
+	 * A fake null return address for the entry, so as it
+	 * starts with the stack aligned like right after a call.
+	 */
+	top -= 8;
+	*(uint64_t *) top = 0;
+#endif
+	char *sp = (char *) top - CORO_CTX_FRAME_SIZE;
+	memset(sp, 0, CORO_CTX_FRAME_SIZE);
+#if defined(__x86_64__)
+	/* Default MXCSR and x87 control word. */
+	*(uint32_t *) sp = 0x1F80;
+	*(uint32_t *) (sp + 4) = 0x037F;
+#endif
+	*(uintptr_t *) (sp + CORO_CTX_FRAME_RET) = (uintptr_t) entry;
+	ctx->sp = sp;
+}
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	coro_ctx_switch_asm(&from->sp, to->sp);
+}
+
+const char *
+coro_switch_backend(void)
+{
+#if defined(__x86_64__)
+	return "asm-x86_64";
+#else
+	return "asm-aarch64";
+#endif
+}
+
+#else /* CORO_SWITCH_UCONTEXT */
+
+static void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	if (getcontext(&ctx->uc) != 0)
+		handle_error();
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = stack_size;
+	ctx->uc.uc_link = NULL;
+	makecontext(&ctx->uc, entry, 0);
+}
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (swapcontext(&from->uc, &to->uc) != 0)
+		handle_error();
+}
+
+const char *
+coro_switch_backend(void)
+{
+	return "ucontext";
+}
+
+#endif /* CORO_SWITCH_ASM */
+
+enum {
+	/** Max number of free stacks kept per size class. */
+	CORO_STACK_CACHE_MAX = 1024,
+	/** Size classes are powers of 2 in pages. */
+	CORO_STACK_CLASS_COUNT = 48,
+	/** Minimal usable stack size in pages. */
+	CORO_STACK_MIN_PAGES = 4,
+	/** Top pages of a free stack left committed for the next owner. */
+	CORO_STACK_KEEP_PAGES = 4,
+	/** Max bytes left committed in all the cached stacks of a thread. */
+	CORO_STACK_KEEP_MAX = 16 * 1024 * 1024,
+};
+
+/**
+ * Cache of free stacks. Coroutines are often created and deleted
+ * in big batches, and mmap/munmap of each stack would cost more
+ * than the coroutine work itself. The cache is per thread, so a
+ * stack goes to the cache of the thread deleting the coroutine.
+ */
+struct coro_stack_cache {
+	struct coro_stack *first;
+	int count;
+};
+
+static __thread struct coro_stack_cache
+coro_stack_cache[CORO_STACK_CLASS_COUNT];
+
+/** Sum of coro_stack.kept over the cache of the thread. */
+static __thread size_t coro_stack_cache_kept;
+
+static size_t
+coro_page_size(void)
+{
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = (size_t) sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+/**
+ * Size class of a stack having @a stack_size usable bytes. The
+ * size itself is rounded up to the class size.
+ */
+static int
+coro_stack_class(size_t *stack_size)
+{
+	size_t page_size = coro_page_size();
+	size_t pages = (*stack_size + page_size - 1) / page_size;
+	if (pages < CORO_STACK_MIN_PAGES)
+		pages = CORO_STACK_MIN_PAGES;
+	int cls = 0;
+	while (((size_t) 1 << cls) < pages)
+		++cls;
+	*stack_size = ((size_t) 1 << cls) * page_size;
+	return cls;
+}
+
+static inline char *
+coro_stack_base(const struct coro_stack *s)
+{
+	return s->map + coro_page_size();
+}
+
+static inline size_t
+coro_stack_bytes(const struct coro_stack *s)
+{
+	return s->map_size - coro_page_size();
+}
+
+static struct coro_stack *
+coro_stack_new(size_t stack_size)
+{
+	int cls = coro_stack_class(&stack_size);
+	if (cls >= CORO_STACK_CLASS_COUNT) {
+		errno = EINVAL;
+		handle_error();
+	}
+	struct coro_stack_cache *cache = &coro_stack_cache[cls];
+	struct coro_stack *s = cache->first;
+	if (s != NULL) {
+		cache->first = s->next;
+		--cache->count;
+		coro_stack_cache_kept -= s->kept;
+		return s;
+	}
+	s = (struct coro_stack *) malloc(sizeof(*s));
+	if (s == NULL)
+		handle_error();
+	s->kept = 0;
+	s->map_size = stack_size + coro_page_size();
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, flags,
+		      -1, 0);
+	if (s->map == MAP_FAILED)
+		handle_error();
+	/*
+	 * Each guard page splits the mapping in two, and the
+	 * kernel limits their number (vm.max_map_count on Linux).
+	 * Hundreds of thousands of coroutines better live without
+	 * the guard than not at all.
+	 */
+	if (mprotect(s->map, coro_page_size(), PROT_NONE) != 0 &&
+	    errno != ENOMEM)
+		handle_error();
+	return s;
+}
+
+static void
+coro_stack_delete(struct coro_stack *s)
+{
+	size_t stack_size = coro_stack_bytes(s);
+	struct coro_stack_cache *cache =
+		&coro_stack_cache[coro_stack_class(&stack_size)];
+	if (cache->count >= CORO_STACK_CACHE_MAX) {
+		munmap(s->map, s->map_size);
+		free(s);
+		return;
+	}
+	/*
+	 * Give the committed pages back except the few at the top.
+	 * Every coroutine touches those right at the start, and
+	 * faulting them in again would cost more than the cache
+	 * saves on mmap. The rest is zeroed on demand for the next
+	 * owner, and the kept pages are limited per thread.
+	 */
+	size_t keep = CORO_STACK_KEEP_PAGES * coro_page_size();
+	if (keep > stack_size ||
+	    coro_stack_cache_kept + keep > CORO_STACK_KEEP_MAX)
+		keep = 0;
+	if (madvise(coro_stack_base(s), stack_size - keep,
+		    MADV_DONTNEED) != 0)
+		handle_error();
+	s->kept = keep;
+	coro_stack_cache_kept += keep;
+	s->next = cache->first;
+	cache->first = s;
+	++cache->count;
+}
+
+/** Unmap all the stacks cached by the current thread. */
+static void
+coro_stack_cache_flush(void)
+{
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct coro_stack_cache *cache = &coro_stack_cache[i];
+		struct coro_stack *s;
+		while ((s = cache->first) != NULL) {
+			cache->first = s->next;
+			munmap(s->map, s->map_size);
+			free(s);
+		}
+		cache->count = 0;
+	}
+	coro_stack_cache_kept = 0;
+}
+
+/**
+ * Peak usage of the stack. The pages are committed only when
+ * touched and never given back while the coroutine is alive, so
+ * the resident page count is the high-water mark. A stack from
+ * the cache can have up to CORO_STACK_KEEP_PAGES of its previous
+ * owner committed, so for it the usage is at least that.
+ */
+static size_t
+coro_stack_used(const struct coro_stack *s)
+{
+	size_t page_size = coro_page_size();
+	size_t pages = coro_stack_bytes(s) / page_size;
+	unsigned char vec[256];
+	size_t used = 0;
+	for (size_t i = 0; i < pages; i += sizeof(vec)) {
+		size_t count = pages - i;
+		if (count > sizeof(vec))
+			count = sizeof(vec);
+		if (mincore(coro_stack_base(s) + i * page_size,
+			    count * page_size, (void *) vec) != 0)
+			handle_error();
+		for (size_t j = 0; j < count; ++j)
+			used += vec[j] & 1;
+	}
+	return used * page_size;
+}
+
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	if (q->last == NULL)
+		q->first = c;
+	else
+		q->last->next = c;
+	q->last = c;
+}
+
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c == NULL)
+		return NULL;
+	q->first = c->next;
+	if (q->first == NULL)
+		q->last = NULL;
+	return c;
+}
+
+/**
+ * Scheduler of the current thread. A coroutine can be suspended
+ * on one thread and resumed on another, so the thread-local
+ * address must never be cached by the compiler across a context
+ * switch. Hence the function is never inlined.
+ */
+static struct coro_worker * __attribute__((noinline))
+coro_worker_self(void)
+{
+	__asm__ volatile("" ::: "memory");
+	return coro_worker_ptr;
+}
+
+static inline bool
+coro_runtime_is_mt(const struct coro_runtime *rt)
+{
+	return rt->worker_count > 1;
+}
+
+/** A coroutine can be suspended only if it is not a scheduler. */
+static inline bool
+coro_worker_can_park(const struct coro_worker *w)
+{
+	return w != NULL && w->this_ptr != &w->sched;
+}
+
+static long long
+coro_clock_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (long long) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+/** Interrupt a worker sleeping in the reactor, if any. */
+static void
+coro_reactor_interrupt(struct coro_runtime *rt)
+{
+#ifdef CORO_HAVE_EPOLL
+	if (! atomic_load(&rt->is_polling))
+		return;
+	uint64_t one = 1;
+	if (write(rt->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+#else
+	(void) rt;
+#endif
+}
+
+/**
+ * New work has appeared: wake up a sleeping worker, if any, to
+ * pick it.
+ */
+static void
+coro_runtime_kick(struct coro_runtime *rt)
+{
+	atomic_fetch_add(&rt->work_seq, 1);
+	if (atomic_load(&rt->idle_count) > 0) {
+		pthread_mutex_lock(&rt->mutex);
+		pthread_cond_signal(&rt->cond);
+		pthread_mutex_unlock(&rt->mutex);
+	}
+	coro_reactor_interrupt(rt);
+}
+
+/**
+ * A worker has got a new ready coroutine. Only other workers could
+ * want to steal it, so it is a nop in a single-threaded runtime.
+ */
+static inline void
+coro_runtime_notify(struct coro_runtime *rt)
+{
+	if (coro_runtime_is_mt(rt))
+		coro_runtime_kick(rt);
+}
+
+/**
+ * Update the ready queue length. It is changed only under the
+ * queue lock, so a plain store is enough - no need in a costly
+ * atomic read-modify-write.
+ */
+static inline void
+coro_ready_count_add(struct coro_worker *w, int delta)
+{
+	int count = atomic_load_explicit(&w->ready_count, memory_order_relaxed);
+	atomic_store_explicit(&w->ready_count, count + delta,
+			      memory_order_relaxed);
+}
+
+static inline long long
+coro_latency(const struct coro_runtime *rt, const struct coro *c)
+{
+	if (c->latency != 0)
+		return c->latency;
+	return atomic_load_explicit(&rt->latency, memory_order_relaxed);
+}
+
+static void
+coro_ready_heap_push(struct coro_worker *w, struct coro *c)
+{
+	if (w->ready_heap_size == w->ready_heap_capacity) {
+		int capacity = w->ready_heap_capacity * 2;
+		if (capacity == 0)
+			capacity = 16;
+		struct coro **heap = realloc(w->ready_heap,
+					     capacity * sizeof(heap[0]));
+		if (heap == NULL)
+			handle_error();
+		w->ready_heap = heap;
+		w->ready_heap_capacity = capacity;
+	}
+	int i = w->ready_heap_size++;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (w->ready_heap[parent]->deadline <= c->deadline)
+			break;
+		w->ready_heap[i] = w->ready_heap[parent];
+		i = parent;
+	}
+	w->ready_heap[i] = c;
+}
+
+static struct coro *
+coro_ready_heap_pop(struct coro_worker *w)
+{
+	struct coro **heap = w->ready_heap;
+	struct coro *top = heap[0];
+	struct coro *c = heap[--w->ready_heap_size];
+	int count = w->ready_heap_size;
+	int i = 0;
+	while (true) {
+		int child = 2 * i + 1;
+		if (child >= count)
+			break;
+		if (child + 1 < count &&
+		    heap[child + 1]->deadline < heap[child]->deadline)
+			++child;
+		if (c->deadline <= heap[child]->deadline)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (count > 0)
+		heap[i] = c;
+	return top;
+}
+
+/** Deadline of the first ready coroutine, LLONG_MAX if none. */
+static inline long long
+coro_ready_next_deadline(const struct coro_worker *w)
+{
+	long long deadline = LLONG_MAX;
+	if (w->ready.first != NULL)
+		deadline = w->ready.first->deadline;
+	if (w->ready_heap_size > 0 && w->ready_heap[0]->deadline < deadline)
+		deadline = w->ready_heap[0]->deadline;
+	return deadline;
+}
+
+/**
+ * Make a coroutine ready at the moment @a now. Its deadline is
+ * counted from that moment.
+ */
+static void
+coro_ready_push(struct coro_worker *w, struct coro *c, long long now)
+{
+	c->worker = w;
+	c->ready_time = now;
+	c->deadline = now + coro_latency(w->rt, c);
+	bool is_mt = coro_runtime_is_mt(w->rt);
+	if (is_mt)
+		pthread_mutex_lock(&w->mutex);
+	if (w->ready.last == NULL || w->ready.last->deadline <= c->deadline)
+		coro_queue_push(&w->ready, c);
+	else
+		coro_ready_heap_push(w, c);
+	coro_ready_count_add(w, 1);
+	/* The running coroutine should not make it late. */
+	if (c->deadline < atomic_load_explicit(&w->slice_end,
+					       memory_order_relaxed))
+		atomic_store_explicit(&w->slice_end, c->deadline,
+				      memory_order_relaxed);
+	if (is_mt)
+		pthread_mutex_unlock(&w->mutex);
+	coro_runtime_notify(w->rt);
+}
+
+/**
+ * Take the coroutine with the earliest deadline. The deadline of
+ * the next one is returned in @a next_deadline.
+ */
+static inline struct coro *
+coro_ready_take(struct coro_worker *w, long long *next_deadline)
+{
+	struct coro *c = w->ready.first;
+	if (w->ready_heap_size > 0 &&
+	    (c == NULL || w->ready_heap[0]->deadline < c->deadline))
+		c = coro_ready_heap_pop(w);
+	else if (c != NULL)
+		coro_queue_pop(&w->ready);
+	if (c != NULL)
+		coro_ready_count_add(w, -1);
+	*next_deadline = coro_ready_next_deadline(w);
+	return c;
+}
+
+static struct coro *
+coro_ready_pop(struct coro_worker *w, long long *next_deadline)
+{
+	if (! coro_runtime_is_mt(w->rt))
+		return coro_ready_take(w, next_deadline);
+	if (atomic_load_explicit(&w->ready_count, memory_order_relaxed) == 0)
+		return NULL;
+	pthread_mutex_lock(&w->mutex);
+	struct coro *c = coro_ready_take(w, next_deadline);
+	pthread_mutex_unlock(&w->mutex);
+	return c;
+}
+
+/**
+ * Migrate a ready coroutine from the most loaded other worker.
+ * The most urgent one is taken.
+ */
+static struct coro *
+coro_ready_steal(struct coro_worker *w, long long *next_deadline)
+{
+	struct coro_runtime *rt = w->rt;
+	struct coro_worker *victim = NULL;
+	int max = 0;
+	for (int i = 0; i < rt->worker_count; ++i) {
+		struct coro_worker *v = &rt->workers[i];
+		int count = atomic_load_explicit(&v->ready_count,
+						 memory_order_relaxed);
+		if (v != w && count > max) {
+			max = count;
+			victim = v;
+		}
+	}
+	if (victim == NULL)
+		return NULL;
+	/*
+	 * Only a worker with an empty queue steals, so nobody is
+	 * waiting after the stolen coroutine here.
+	 */
+	long long unused;
+	*next_deadline = LLONG_MAX;
+	return coro_ready_pop(victim, &unused);
+}
+
+/**
+ * Load balancer: the worker to put a new coroutine to - the one
+ * with the shortest ready queue, the current one on a tie.
+ */
+static struct coro_worker *
+coro_runtime_pick(struct coro_worker *w)
+{
+	struct coro_runtime *rt = w->rt;
+	struct coro_worker *best = w;
+	int min = atomic_load_explicit(&w->ready_count, memory_order_relaxed);
+	for (int i = 0; i < rt->worker_count && min > 0; ++i) {
+		struct coro_worker *v = &rt->workers[i];
+		int count = atomic_load_explicit(&v->ready_count,
+						 memory_order_relaxed);
+		if (count < min) {
+			min = count;
+			best = v;
+		}
+	}
+	return best;
+}
+
+/** Make ready a coroutine woken up by a foreign thread. */
+static void
+coro_remote_push(struct coro_runtime *rt, struct coro *c)
+{
+	pthread_mutex_lock(&rt->mutex);
+	coro_queue_push(&rt->remote, c);
+	atomic_fetch_add(&rt->remote_count, 1);
+	pthread_mutex_unlock(&rt->mutex);
+	coro_runtime_kick(rt);
+}
+
+/** Move the remotely woken up coroutines to the worker. */
+static void
+coro_remote_drain(struct coro_worker *w)
+{
+	struct coro_runtime *rt = w->rt;
+	pthread_mutex_lock(&rt->mutex);
+	struct coro_queue q = rt->remote;
+	rt->remote.first = rt->remote.last = NULL;
+	atomic_store(&rt->remote_count, 0);
+	pthread_mutex_unlock(&rt->mutex);
+	long long now = coro_clock_ns();
+	struct coro *c;
+	while ((c = coro_queue_pop(&q)) != NULL)
+		coro_ready_push(w, c, now);
+}
+
+static void
+coro_finished_push(struct coro_runtime *rt, struct coro *c)
+{
+	if (! coro_runtime_is_mt(rt)) {
+		coro_queue_push(&rt->finished, c);
+		return;
+	}
+	pthread_mutex_lock(&rt->mutex);
+	coro_queue_push(&rt->finished, c);
+	atomic_fetch_add(&rt->work_seq, 1);
+	pthread_cond_broadcast(&rt->cond);
+	pthread_mutex_unlock(&rt->mutex);
+	coro_reactor_interrupt(rt);
+}
+
+static struct coro *
+coro_finished_pop(struct coro_runtime *rt)
+{
+	bool is_mt = coro_runtime_is_mt(rt);
+	if (is_mt)
+		pthread_mutex_lock(&rt->mutex);
+	struct coro *c = coro_queue_pop(&rt->finished);
+	if (c != NULL)
+		atomic_fetch_sub(&rt->coro_count, 1);
+	if (is_mt)
+		pthread_mutex_unlock(&rt->mutex);
+	return c;
+}
+
+/** Timer heap. */
+
+static inline bool
+coro_timer_less(const struct coro_timer *a, const struct coro_timer *b)
+{
+	return a->deadline < b->deadline;
+}
+
+static inline void
+coro_timer_set(struct coro_runtime *rt, int i, struct coro_timer *t)
+{
+	rt->timers[i] = t;
+	t->index = i;
+}
+
+static void
+coro_timer_sift_up(struct coro_runtime *rt, int i)
+{
+	struct coro_timer *t = rt->timers[i];
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (! coro_timer_less(t, rt->timers[parent]))
+			break;
+		coro_timer_set(rt, i, rt->timers[parent]);
+		i = parent;
+	}
+	coro_timer_set(rt, i, t);
+}
+
+static void
+coro_timer_sift_down(struct coro_runtime *rt, int i)
+{
+	int count = atomic_load_explicit(&rt->timer_count,
+					 memory_order_relaxed);
+	struct coro_timer *t = rt->timers[i];
+	while (true) {
+		int child = 2 * i + 1;
+		if (child >= count)
+			break;
+		if (child + 1 < count &&
+		    coro_timer_less(rt->timers[child + 1], rt->timers[child]))
+			++child;
+		if (! coro_timer_less(rt->timers[child], t))
+			break;
+		coro_timer_set(rt, i, rt->timers[child]);
+		i = child;
+	}
+	coro_timer_set(rt, i, t);
+}
+
+static void
+coro_timer_add(struct coro_runtime *rt, struct coro_timer *t)
+{
+	pthread_mutex_lock(&rt->timer_mutex);
+	int count = atomic_load_explicit(&rt->timer_count,
+					 memory_order_relaxed);
+	if (count == rt->timer_capacity) {
+		int capacity = rt->timer_capacity * 2 + 16;
+		rt->timers = realloc(rt->timers,
+				     capacity * sizeof(rt->timers[0]));
+		if (rt->timers == NULL)
+			handle_error();
+		rt->timer_capacity = capacity;
+	}
+	rt->timers[count] = t;
+	atomic_store(&rt->timer_count, count + 1);
+	coro_timer_sift_up(rt, count);
+	pthread_mutex_unlock(&rt->timer_mutex);
+	/* A sleeping worker may need to wake up earlier now. */
+	coro_reactor_interrupt(rt);
+	if (atomic_load(&rt->idle_count) > 0) {
+		pthread_mutex_lock(&rt->mutex);
+		pthread_cond_broadcast(&rt->cond);
+		pthread_mutex_unlock(&rt->mutex);
+	}
+}
+
+/** Remove the heap top. Called under the timer mutex. */
+static struct coro_timer *
+coro_timer_pop(struct coro_runtime *rt)
+{
+	int count = atomic_load_explicit(&rt->timer_count,
+					 memory_order_relaxed) - 1;
+	struct coro_timer *top = rt->timers[0];
+	atomic_store(&rt->timer_count, count);
+	if (count > 0) {
+		coro_timer_set(rt, 0, rt->timers[count]);
+		coro_timer_sift_down(rt, 0);
+	}
+	return top;
+}
+
+/** Deadline of the nearest timer, or -1 if there are none. */
+static long long
+coro_timers_next(struct coro_runtime *rt)
+{
+	if (atomic_load(&rt->timer_count) == 0)
+		return -1;
+	pthread_mutex_lock(&rt->timer_mutex);
+	long long deadline = -1;
+	if (atomic_load_explicit(&rt->timer_count, memory_order_relaxed) > 0)
+		deadline = rt->timers[0]->deadline;
+	pthread_mutex_unlock(&rt->timer_mutex);
+	return deadline;
+}
+
+/** Wake up the coroutines whose sleep is over. */
+static void
+coro_timers_expire(struct coro_runtime *rt)
+{
+	if (atomic_load(&rt->timer_count) == 0)
+		return;
+	long long now = coro_clock_ns();
+	struct coro_queue expired = {NULL, NULL};
+	pthread_mutex_lock(&rt->timer_mutex);
+	while (atomic_load_explicit(&rt->timer_count,
+				    memory_order_relaxed) > 0 &&
+	       rt->timers[0]->deadline <= now)
+		coro_queue_push(&expired, coro_timer_pop(rt)->c);
+	pthread_mutex_unlock(&rt->timer_mutex);
+	struct coro *c;
+	while ((c = coro_queue_pop(&expired)) != NULL)
+		coro_wakeup(c);
+}
+
+/** Reactor. */
+
+/**
+ * Wait for fd events up to @a timeout_ms and wake up their
+ * coroutines. Must be called only by the worker which has set
+ * is_polling.
  */
-static sigjmp_buf start_point;
+static void
+coro_reactor_poll(struct coro_runtime *rt, int timeout_ms)
+{
+#ifdef CORO_HAVE_EPOLL
+	struct epoll_event events[CORO_POLL_EVENTS];
+	int count = epoll_wait(rt->epoll_fd, events, CORO_POLL_EVENTS,
+			       timeout_ms);
+	if (count < 0 && errno != EINTR)
+		handle_error();
+	for (int i = 0; i < count; ++i) {
+		struct coro *c = (struct coro *) events[i].data.ptr;
+		if (c != NULL) {
+			coro_wakeup(c);
+			continue;
+		}
+		uint64_t value;
+		if (read(rt->event_fd, &value, sizeof(value)) < 0 &&
+		    errno != EAGAIN)
+			handle_error();
+	}
+#else
+	(void) rt;
+	(void) timeout_ms;
+#endif
+}
 
-/** Add a new coroutine to the beginning of the list. */
+/** Check fd events and timers without blocking. */
 static void
-coro_list_add(struct coro *c)
+coro_worker_poll(struct coro_worker *w)
+{
+	struct coro_runtime *rt = w->rt;
+	if (atomic_load_explicit(&rt->io_wait_count,
+				 memory_order_relaxed) > 0 &&
+	    ! atomic_exchange(&rt->is_polling, true)) {
+		coro_reactor_poll(rt, 0);
+		atomic_store(&rt->is_polling, false);
+	}
+	coro_timers_expire(rt);
+}
+
+/**
+ * Pick up the remote wakeups, and once per CORO_POLL_PERIOD
+ * scheduling rounds - fd events and timers.
+ */
+static inline void
+coro_worker_tick(struct coro_worker *w)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	if (atomic_load_explicit(&w->rt->remote_count,
+				 memory_order_relaxed) != 0)
+		coro_remote_drain(w);
+	if ((++w->tick & (CORO_POLL_PERIOD - 1)) == 0)
+		coro_worker_poll(w);
 }
 
-/** Remove a coroutine from the list. */
+/**
+ * Sleep until new work appears in the runtime, or the nearest
+ * timer expires. @a seq is the work sequence seen before the
+ * worker found nothing to do. One of the sleeping workers waits
+ * in the reactor, the others - on the condition variable.
+ */
 static void
-coro_list_delete(struct coro *c)
+coro_worker_idle(struct coro_worker *w, unsigned seq)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	struct coro_runtime *rt = w->rt;
+	long long deadline = coro_timers_next(rt);
+#ifdef CORO_HAVE_EPOLL
+	if (! atomic_exchange(&rt->is_polling, true)) {
+		if (atomic_load(&rt->work_seq) == seq &&
+		    ! atomic_load(&rt->is_shutdown)) {
+			int timeout_ms = -1;
+			if (deadline >= 0) {
+				long long left = deadline - coro_clock_ns();
+				timeout_ms = left <= 0 ? 0 :
+					     (int) ((left + 999999) / 1000000);
+			}
+			coro_reactor_poll(rt, timeout_ms);
+		}
+		atomic_store(&rt->is_polling, false);
+		coro_timers_expire(rt);
+		return;
+	}
+#endif
+	pthread_mutex_lock(&rt->mutex);
+	atomic_fetch_add(&rt->idle_count, 1);
+	while (atomic_load(&rt->work_seq) == seq &&
+	       ! atomic_load(&rt->is_shutdown)) {
+		if (deadline < 0) {
+			pthread_cond_wait(&rt->cond, &rt->mutex);
+			continue;
+		}
+		long long left = deadline - coro_clock_ns();
+		if (left <= 0)
+			break;
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		long long abs = (long long) ts.tv_sec * 1000000000 +
+				ts.tv_nsec + left;
+		ts.tv_sec = abs / 1000000000;
+		ts.tv_nsec = abs % 1000000000;
+		if (pthread_cond_timedwait(&rt->cond, &rt->mutex, &ts) ==
+		    ETIMEDOUT)
+			break;
+	}
+	atomic_fetch_sub(&rt->idle_count, 1);
+	pthread_mutex_unlock(&rt->mutex);
+	coro_timers_expire(rt);
 }
 
 int
@@ -91,167 +1288,852 @@ coro_is_finished(const struct coro *c)
 	return c->is_finished;
 }
 
+size_t
+coro_stack_size(const struct coro *c)
+{
+	return c->stack != NULL ? coro_stack_bytes(c->stack) : 0;
+}
+
+size_t
+coro_stack_usage(const struct coro *c)
+{
+	return c->stack != NULL ? coro_stack_used(c->stack) : 0;
+}
+
 void
 coro_delete(struct coro *c)
 {
-	free(c->stack);
+	coro_stack_delete(c->stack);
 	free(c);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+/**
+ * Publish the coroutine switched away from. Called right after
+ * each context switch, on the thread where the execution was
+ * resumed.
+ */
+static void
+coro_switch_finish(void)
+{
+	struct coro_worker *w = coro_worker_self();
+	/*
+	 * Ready-to-run latency is accounted by the coroutine itself,
+	 * when its memory is hot anyway.
+	 */
+	struct coro *self = w->this_ptr;
+	if (self != &w->sched) {
+		long long latency = w->run_start - self->ready_time;
+		if (latency > self->max_latency)
+			self->max_latency = latency;
+	}
+	struct coro *c = w->pending;
+	if (c == NULL)
+		return;
+	w->pending = NULL;
+	if (c->is_finished) {
+		coro_finished_push(w->rt, c);
+		return;
+	}
+	if (w->is_pending_park) {
+		w->is_pending_park = false;
+		int state = CORO_PARK_NONE;
+		if (atomic_compare_exchange_strong(&c->park_state, &state,
+						   CORO_PARK_SUSPENDED))
+			return;
+		/* Has been woken up already. */
+		atomic_store(&c->park_state, CORO_PARK_NONE);
+	}
+	/* It has become ready when the switch started. */
+	coro_ready_push(w, c, w->run_start);
+}
+
+/**
+ * Give @a c a time slice starting at @a now. It is a fair share of
+ * the latency among the ready coroutines, but ends not later than
+ * the earliest deadline among them, @a next_deadline.
+ */
+static inline void
+coro_slice_begin(struct coro_worker *w, struct coro *c, long long now,
+		 long long next_deadline)
+{
+	int waiting = atomic_load_explicit(&w->ready_count,
+					   memory_order_relaxed);
+	long long slice = coro_latency(w->rt, c) / (waiting + 1);
+	if (slice < CORO_SLICE_MIN)
+		slice = CORO_SLICE_MIN;
+	long long end = now + slice;
+	if (next_deadline < end) {
+		end = next_deadline;
+		if (end < now + CORO_SLICE_MIN)
+			end = now + CORO_SLICE_MIN;
+	}
+	atomic_store_explicit(&w->slice_end, end, memory_order_relaxed);
+}
+
+/**
+ * Account the run of @a from, the current coroutine of @a w, which
+ * ends at @a now.
+ */
+static inline void
+coro_run_end(struct coro_worker *w, struct coro *from, long long now)
+{
+	long long run = now - w->run_start;
+	from->work_time += run;
+	if (run > from->max_slice)
+		from->max_slice = run;
+	w->run_start = now;
+}
+
+/**
+ * Switch the current coroutine of @a w to an arbitrary one. When
+ * the current coroutine is resumed, it may be on another thread.
+ */
 static void
-coro_yield_to(struct coro *to)
+coro_yield_to(struct coro_worker *w, struct coro *to,
+	      long long next_deadline)
 {
-	struct coro *from = coro_this_ptr;
+	struct coro *from = w->this_ptr;
+	long long now = coro_clock_ns();
+	coro_run_end(w, from, now);
+	coro_slice_begin(w, to, now, next_deadline);
 	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	w->this_ptr = to;
+	to->worker = w;
+	coro_ctx_switch(&from->ctx, &to->ctx);
+	coro_switch_finish();
+}
+
+/**
+ * Switch to the most urgent ready coroutine. Returns false, if
+ * there are none, and the current one goes on.
+ */
+static bool
+coro_yield_ready(struct coro_worker *w)
+{
+	struct coro *from = w->this_ptr;
+	/*
+	 * The scheduler is not in the ready queue - it is woken
+	 * up only by finished coroutines.
+	 */
+	if (from == &w->sched)
+		return false;
+	coro_worker_tick(w);
+	long long next_deadline;
+	struct coro *to = coro_ready_pop(w, &next_deadline);
+	if (to == NULL)
+		return false;
+	w->pending = from;
+	coro_yield_to(w, to, next_deadline);
+	return true;
 }
 
 void
 coro_yield(void)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
+	coro_yield_ready(coro_worker_self());
+}
+
+bool
+coro_yield_if_expired(void)
+{
+	struct coro_worker *w = coro_worker_self();
+	if (! coro_worker_can_park(w))
+		return false;
+	long long now = coro_clock_ns();
+	if (now < atomic_load_explicit(&w->slice_end, memory_order_relaxed))
+		return false;
+	if (coro_yield_ready(w))
+		return true;
+	/* Nobody is waiting - go on with a new slice. */
+	coro_slice_begin(w, w->this_ptr, now, LLONG_MAX);
+	return false;
+}
+
+void
+coro_sched_set_latency(uint64_t usec)
+{
+	struct coro_worker *w = coro_worker_self();
+	atomic_store(&w->rt->latency, (long long) usec * 1000);
+}
+
+void
+coro_set_latency(struct coro *c, uint64_t usec)
+{
+	c->latency = (long long) usec * 1000;
+}
+
+uint64_t
+coro_work_time(const struct coro *c)
+{
+	struct coro_stats stats;
+	coro_stats(c, &stats);
+	return stats.work_time;
+}
+
+void
+coro_stats(const struct coro *c, struct coro_stats *stats)
+{
+	long long now = coro_clock_ns();
+	long long work_time = c->work_time;
+	long long max_slice = c->max_slice;
+	struct coro_worker *w = coro_worker_self();
+	if (w != NULL && w->this_ptr == c) {
+		/* The current run is not accounted yet. */
+		long long run = now - w->run_start;
+		work_time += run;
+		if (run > max_slice)
+			max_slice = run;
+	}
+	long long end = c->is_finished ? c->finish_time : now;
+	long long wait_time = end - c->create_time - work_time;
+	stats->work_time = work_time / 1000;
+	stats->wait_time = wait_time > 0 ? wait_time / 1000 : 0;
+	stats->max_slice = max_slice / 1000;
+	stats->max_latency = c->max_latency / 1000;
+	stats->switch_count = c->switch_count;
+	stats->stack_size = coro_stack_size(c);
+	stats->stack_usage = coro_stack_usage(c);
+}
+
+void
+coro_stats_dump(const struct coro *c, FILE *out)
+{
+	struct coro_stats s;
+	coro_stats(c, &s);
+	fprintf(out, "%lld switches, work %.6f s, wait %.6f s, "
+		"max slice %.3f ms, max latency %.3f ms, "
+		"stack %zu of %zu bytes\n", s.switch_count,
+		s.work_time * 0.000001, s.wait_time * 0.000001,
+		s.max_slice * 0.001, s.max_latency * 0.001, s.stack_usage,
+		s.stack_size);
+}
+
+void
+coro_suspend(void)
+{
+	struct coro_worker *w = coro_worker_self();
+	if (! coro_worker_can_park(w)) {
+		printf("Critical error - the scheduler can not suspend!\n");
+		exit(-1);
+	}
+	long long next_deadline;
+	struct coro *to = coro_ready_pop(w, &next_deadline);
 	if (to == NULL)
-		coro_yield_to(&coro_sched);
+		to = &w->sched;
+	w->pending = w->this_ptr;
+	w->is_pending_park = true;
+	coro_yield_to(w, to, next_deadline);
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	int state = atomic_load(&c->park_state);
+	while (true) {
+		if (state == CORO_PARK_WOKEN)
+			return;
+		int next = state == CORO_PARK_NONE ? CORO_PARK_WOKEN :
+						      CORO_PARK_NONE;
+		if (atomic_compare_exchange_weak(&c->park_state, &state, next))
+			break;
+	}
+	/* Is not suspended yet - it will see the token itself. */
+	if (state == CORO_PARK_NONE)
+		return;
+	struct coro_worker *w = coro_worker_self();
+	if (w != NULL && w->rt == c->worker->rt)
+		coro_ready_push(w, c, coro_clock_ns());
+	else
+		coro_remote_push(c->worker->rt, c);
+}
+
+void
+coro_sleep(uint64_t usec)
+{
+	struct coro_worker *w = coro_worker_self();
+	if (! coro_worker_can_park(w)) {
+		usleep(usec);
+		return;
+	}
+	struct coro_timer t;
+	t.deadline = coro_clock_ns() + (long long) usec * 1000;
+	t.c = w->this_ptr;
+	coro_timer_add(w->rt, &t);
+	/* The timer is the only one who can wake the coroutine up. */
+	coro_suspend();
+}
+
+/** Helper threads serving blocking file I/O. */
+static void *
+coro_io_thread_f(void *arg)
+{
+	struct coro_runtime *rt = (struct coro_runtime *) arg;
+	pthread_mutex_lock(&rt->io_mutex);
+	while (true) {
+		while (rt->io_first == NULL && ! rt->is_io_shutdown)
+			pthread_cond_wait(&rt->io_cond, &rt->io_mutex);
+		if (rt->io_first == NULL)
+			break;
+		struct coro_io_job *job = rt->io_first;
+		rt->io_first = job->next;
+		if (rt->io_first == NULL)
+			rt->io_last = NULL;
+		pthread_mutex_unlock(&rt->io_mutex);
+
+		if (job->is_write)
+			job->result = write(job->fd, job->buf, job->count);
+		else
+			job->result = read(job->fd, job->buf, job->count);
+		job->error = errno;
+		/*
+		 * The job is on the coroutine stack - it must not be
+		 * touched after the wakeup.
+		 */
+		coro_wakeup(job->c);
+
+		pthread_mutex_lock(&rt->io_mutex);
+	}
+	pthread_mutex_unlock(&rt->io_mutex);
+	return NULL;
+}
+
+/** Do the blocking call in a helper thread, park meanwhile. */
+static ssize_t
+coro_io_offload(struct coro_worker *w, bool is_write, int fd, void *buf,
+		size_t count)
+{
+	struct coro_runtime *rt = w->rt;
+	struct coro_io_job job;
+	job.is_write = is_write;
+	job.fd = fd;
+	job.buf = buf;
+	job.count = count;
+	job.c = w->this_ptr;
+	job.next = NULL;
+	pthread_mutex_lock(&rt->io_mutex);
+	if (rt->io_last == NULL)
+		rt->io_first = &job;
 	else
-		coro_yield_to(to);
+		rt->io_last->next = &job;
+	rt->io_last = &job;
+	if (rt->io_thread_count < CORO_IO_THREADS) {
+		errno = pthread_create(&rt->io_threads[rt->io_thread_count],
+				       NULL, coro_io_thread_f, rt);
+		if (errno != 0)
+			handle_error();
+		++rt->io_thread_count;
+	}
+	pthread_cond_signal(&rt->io_cond);
+	pthread_mutex_unlock(&rt->io_mutex);
+	coro_suspend();
+	errno = job.error;
+	return job.result;
+}
+
+/**
+ * Park the current coroutine until @a fd gets @a events. Returns
+ * -1, if the fd can not be polled - regular files are such.
+ */
+static int
+coro_fd_wait(struct coro_worker *w, int fd, uint32_t events)
+{
+#ifdef CORO_HAVE_EPOLL
+	struct coro_runtime *rt = w->rt;
+	struct epoll_event ev;
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = w->this_ptr;
+	/* The fd usually stays registered since the last wait. */
+	if (epoll_ctl(rt->epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+	    (errno != ENOENT ||
+	     epoll_ctl(rt->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0))
+		return -1;
+	atomic_fetch_add(&rt->io_wait_count, 1);
+	coro_suspend();
+	atomic_fetch_sub(&rt->io_wait_count, 1);
+	return 0;
+#else
+	(void) w;
+	(void) fd;
+	(void) events;
+	return -1;
+#endif
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t count)
+{
+	struct coro_worker *w = coro_worker_self();
+	if (! coro_worker_can_park(w))
+		return read(fd, buf, count);
+#ifdef CORO_HAVE_EPOLL
+	while (coro_fd_wait(w, fd, EPOLLIN) == 0) {
+		ssize_t rc = read(fd, buf, count);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return rc;
+	}
+	if (errno != EPERM)
+		return -1;
+#endif
+	return coro_io_offload(w, false, fd, buf, count);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t count)
+{
+	struct coro_worker *w = coro_worker_self();
+	if (! coro_worker_can_park(w))
+		return write(fd, buf, count);
+#ifdef CORO_HAVE_EPOLL
+	/*
+	 * Readiness guarantees only some free space - a bigger
+	 * write into a blocking pipe or socket could block again.
+	 */
+	size_t chunk = count < PIPE_BUF ? count : PIPE_BUF;
+	while (coro_fd_wait(w, fd, EPOLLOUT) == 0) {
+		ssize_t rc = write(fd, buf, chunk);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return rc;
+	}
+	if (errno != EPERM)
+		return -1;
+#endif
+	return coro_io_offload(w, true, fd, (void *) buf, count);
+}
+
+/**
+ * Run one ready coroutine from the scheduler context of @a w.
+ * Returns false, if there was nothing to run.
+ */
+static bool
+coro_worker_run_one(struct coro_worker *w)
+{
+	coro_worker_tick(w);
+	long long next_deadline;
+	struct coro *c = coro_ready_pop(w, &next_deadline);
+	if (c == NULL && coro_runtime_is_mt(w->rt))
+		c = coro_ready_steal(w, &next_deadline);
+	if (c == NULL)
+		return false;
+	coro_yield_to(w, c, next_deadline);
+	return true;
+}
+
+/** Main loop of the runtime's own worker threads. */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = (struct coro_worker *) arg;
+	struct coro_runtime *rt = w->rt;
+	coro_worker_ptr = w;
+	while (! atomic_load(&rt->is_shutdown)) {
+		unsigned seq = atomic_load(&rt->work_seq);
+		if (! coro_worker_run_one(w))
+			coro_worker_idle(w, seq);
+	}
+	coro_stack_cache_flush();
+	coro_worker_ptr = NULL;
+	return NULL;
 }
 
 void
 coro_sched_init(void)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	coro_sched_init_mt(1);
+}
+
+void
+coro_sched_init_mt(int thread_count)
+{
+	if (coro_worker_ptr != NULL)
+		coro_sched_destroy();
+	if (thread_count < 1)
+		thread_count = 1;
+	struct coro_runtime *rt = calloc(1, sizeof(*rt));
+	if (rt == NULL)
+		handle_error();
+	rt->workers = calloc(thread_count, sizeof(rt->workers[0]));
+	if (rt->workers == NULL)
+		handle_error();
+	rt->worker_count = thread_count;
+	atomic_init(&rt->latency, CORO_LATENCY_DEFAULT);
+	pthread_mutex_init(&rt->mutex, NULL);
+	pthread_cond_init(&rt->cond, NULL);
+	pthread_mutex_init(&rt->timer_mutex, NULL);
+	pthread_mutex_init(&rt->io_mutex, NULL);
+	pthread_cond_init(&rt->io_cond, NULL);
+#ifdef CORO_HAVE_EPOLL
+	rt->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (rt->epoll_fd < 0)
+		handle_error();
+	rt->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rt->event_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(rt->epoll_fd, EPOLL_CTL_ADD, rt->event_fd, &ev) != 0)
+		handle_error();
+#endif
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &rt->workers[i];
+		w->rt = rt;
+		w->this_ptr = &w->sched;
+		w->sched.worker = w;
+		w->is_sched_waiting = i != 0;
+		atomic_init(&w->slice_end, LLONG_MAX);
+		pthread_mutex_init(&w->mutex, NULL);
+	}
+	rt->workers[0].thread = pthread_self();
+	coro_worker_ptr = &rt->workers[0];
+	for (int i = 1; i < thread_count; ++i) {
+		struct coro_worker *w = &rt->workers[i];
+		errno = pthread_create(&w->thread, NULL, coro_worker_f, w);
+		if (errno != 0)
+			handle_error();
+	}
+}
+
+void
+coro_sched_destroy(void)
+{
+	struct coro_worker *w = coro_worker_self();
+	if (w == NULL)
+		return;
+	struct coro_runtime *rt = w->rt;
+	pthread_mutex_lock(&rt->mutex);
+	atomic_store(&rt->is_shutdown, true);
+	pthread_cond_broadcast(&rt->cond);
+	pthread_mutex_unlock(&rt->mutex);
+	coro_runtime_kick(rt);
+	for (int i = 1; i < rt->worker_count; ++i)
+		pthread_join(rt->workers[i].thread, NULL);
+
+	pthread_mutex_lock(&rt->io_mutex);
+	rt->is_io_shutdown = true;
+	pthread_cond_broadcast(&rt->io_cond);
+	pthread_mutex_unlock(&rt->io_mutex);
+	for (int i = 0; i < rt->io_thread_count; ++i)
+		pthread_join(rt->io_threads[i], NULL);
+#ifdef CORO_HAVE_EPOLL
+	close(rt->epoll_fd);
+	close(rt->event_fd);
+#endif
+	for (int i = 0; i < rt->worker_count; ++i) {
+		pthread_mutex_destroy(&rt->workers[i].mutex);
+		free(rt->workers[i].ready_heap);
+	}
+	pthread_cond_destroy(&rt->io_cond);
+	pthread_mutex_destroy(&rt->io_mutex);
+	pthread_mutex_destroy(&rt->timer_mutex);
+	pthread_cond_destroy(&rt->cond);
+	pthread_mutex_destroy(&rt->mutex);
+	free(rt->timers);
+	free(rt->workers);
+	free(rt);
+	coro_worker_ptr = NULL;
+}
+
+int
+coro_sched_thread_count(void)
+{
+	struct coro_worker *w = coro_worker_self();
+	return w != NULL ? w->rt->worker_count : 0;
 }
 
 struct coro *
 coro_sched_wait(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
-		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
+	struct coro_worker *w = coro_worker_self();
+	struct coro_runtime *rt = w->rt;
+	struct coro *c;
+	w->is_sched_waiting = true;
+	while ((c = coro_finished_pop(rt)) == NULL &&
+	       atomic_load(&rt->coro_count) > 0) {
+		unsigned seq = atomic_load(&rt->work_seq);
+		if (! coro_worker_run_one(w))
+			coro_worker_idle(w, seq);
 	}
-	return NULL;
+	w->is_sched_waiting = false;
+	return c;
 }
 
 struct coro *
 coro_this(void)
 {
-	return coro_this_ptr;
+	struct coro_worker *w = coro_worker_self();
+	return w != NULL ? w->this_ptr : NULL;
 }
 
 /**
- * The core part of the coroutines creation - this signal handler
- * is run on a separate stack using sigaltstack. On an invokation
- * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
+ * Entry point of every coroutine. The first switch into a new
+ * coroutine lands here, on top of its own stack.
  */
 static void
-coro_body(int signum)
+coro_body(void)
 {
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
-	/*
-	 * On an invokation jump back to the constructor right
-	 * after remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finaly start work.
-	 */
-	coro_this_ptr = c;
+	coro_switch_finish();
+	struct coro *c = coro_worker_self()->this_ptr;
 	c->ret = c->func(c->func_arg);
 	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
+	/* The coroutine could have migrated to another thread. */
+	struct coro_worker *w = coro_worker_self();
+	/* Can not return - there is no caller frame on the stack! */
+	if (! w->is_sched_waiting) {
 		printf("Critical error - no place to return!\n");
 		exit(-1);
 	}
-	siglongjmp(coro_sched.ctx, 1);
+	/*
+	 * The coroutine is published as finished only after the
+	 * switch, when nothing runs on its stack anymore.
+	 */
+	w->pending = c;
+	long long now = coro_clock_ns();
+	coro_run_end(w, c, now);
+	c->finish_time = now;
+	w->this_ptr = &w->sched;
+	coro_ctx_switch(&c->ctx, &w->sched.ctx);
+	abort();
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, CORO_STACK_SIZE_DEFAULT);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size)
 {
 	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	if (c == NULL)
+		handle_error();
 	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
+	c->stack = coro_stack_new(stack_size);
 	c->func = func;
 	c->func_arg = func_arg;
 	c->is_finished = false;
 	c->switch_count = 0;
+	atomic_init(&c->park_state, CORO_PARK_NONE);
+	c->latency = 0;
+	c->deadline = 0;
+	c->ready_time = 0;
+	c->create_time = coro_clock_ns();
+	c->finish_time = 0;
+	c->work_time = 0;
+	c->max_slice = 0;
+	c->max_latency = 0;
 	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
+	 * The coroutine is not started - only its context is
+	 * prepared so as the first switch into it runs coro_body()
+	 * on the new stack.
 	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
+	coro_ctx_make(&c->ctx, coro_stack_base(c->stack),
+		      coro_stack_bytes(c->stack), coro_body);
+
+	/* Now scheduler can work with that coroutine. */
+	struct coro_worker *w = coro_worker_self();
+	atomic_fetch_add(&w->rt->coro_count, 1);
+	coro_ready_push(coro_runtime_pick(w), c, c->create_time);
+	return c;
+}
+
+/** Wait queues and channels. */
+
+/** A coroutine waiting in a wait list. Lives on its stack. */
+struct coro_waiter {
+	struct coro *c;
+	struct coro_waiter *next;
+};
+
+/**
+ * FIFO of waiting coroutines. Not locked by itself - the owner
+ * protects it together with the condition the coroutines wait for.
+ */
+struct coro_wait_list {
+	struct coro_waiter *first;
+	struct coro_waiter *last;
+};
+
+struct coro_wq {
+	pthread_mutex_t mutex;
+	struct coro_wait_list list;
+};
+
+struct coro_chan {
+	pthread_mutex_t mutex;
+	/** Ring buffer of messages. */
+	void **buf;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	bool is_closed;
+	/** Senders waiting for free space. */
+	struct coro_wait_list senders;
+	/** Receivers waiting for messages. */
+	struct coro_wait_list receivers;
+};
+
+/**
+ * Wait in @a list until woken up. @a mutex protects the list and
+ * is held on entry and on return, but not while suspended.
+ */
+static void
+coro_wait_list_wait(struct coro_wait_list *list, pthread_mutex_t *mutex)
+{
+	struct coro_waiter waiter;
+	waiter.c = coro_this();
+	waiter.next = NULL;
+	if (list->last == NULL)
+		list->first = &waiter;
+	else
+		list->last->next = &waiter;
+	list->last = &waiter;
+	pthread_mutex_unlock(mutex);
 	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
+	 * A wakeup coming before the suspension is not lost - it
+	 * makes coro_suspend() return immediately.
 	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
-		handle_error();
-	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
-			sigsuspend(&suss);
-	}
-	coro_this_ptr = old_this;
+	coro_suspend();
+	pthread_mutex_lock(mutex);
+}
+
+/** Wake up the first waiter. Called under the owner's mutex. */
+static bool
+coro_wait_list_wakeup(struct coro_wait_list *list)
+{
+	struct coro_waiter *waiter = list->first;
+	if (waiter == NULL)
+		return false;
+	list->first = waiter->next;
+	if (list->first == NULL)
+		list->last = NULL;
 	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
+	 * The waiter is on the coroutine's stack, so it is read
+	 * before the coroutine can run and leave.
 	 */
-	if (sigaltstack(NULL, &newst) != 0)
-		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
-		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-	    sigaltstack(&oldst, NULL) != 0)
+	coro_wakeup(waiter->c);
+	return true;
+}
+
+struct coro_wq *
+coro_wq_new(void)
+{
+	struct coro_wq *wq = calloc(1, sizeof(*wq));
+	if (wq == NULL)
 		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
+	pthread_mutex_init(&wq->mutex, NULL);
+	return wq;
+}
+
+void
+coro_wq_delete(struct coro_wq *wq)
+{
+	pthread_mutex_destroy(&wq->mutex);
+	free(wq);
+}
+
+void
+coro_wq_lock(struct coro_wq *wq)
+{
+	pthread_mutex_lock(&wq->mutex);
+}
+
+void
+coro_wq_unlock(struct coro_wq *wq)
+{
+	pthread_mutex_unlock(&wq->mutex);
+}
+
+void
+coro_wq_wait(struct coro_wq *wq)
+{
+	coro_wait_list_wait(&wq->list, &wq->mutex);
+}
+
+void
+coro_wq_wakeup(struct coro_wq *wq)
+{
+	pthread_mutex_lock(&wq->mutex);
+	coro_wait_list_wakeup(&wq->list);
+	pthread_mutex_unlock(&wq->mutex);
+}
+
+void
+coro_wq_wakeup_all(struct coro_wq *wq)
+{
+	pthread_mutex_lock(&wq->mutex);
+	while (coro_wait_list_wakeup(&wq->list))
+		;
+	pthread_mutex_unlock(&wq->mutex);
+}
+
+struct coro_chan *
+coro_chan_new(size_t capacity)
+{
+	if (capacity == 0)
+		capacity = 1;
+	struct coro_chan *ch = calloc(1, sizeof(*ch));
+	if (ch == NULL)
 		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+	ch->buf = calloc(capacity, sizeof(ch->buf[0]));
+	if (ch->buf == NULL)
 		handle_error();
+	ch->capacity = capacity;
+	pthread_mutex_init(&ch->mutex, NULL);
+	return ch;
+}
 
-	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
-	return c;
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	pthread_mutex_destroy(&ch->mutex);
+	free(ch->buf);
+	free(ch);
+}
+
+int
+coro_chan_send(struct coro_chan *ch, void *msg)
+{
+	pthread_mutex_lock(&ch->mutex);
+	while (ch->count == ch->capacity && ! ch->is_closed)
+		coro_wait_list_wait(&ch->senders, &ch->mutex);
+	if (ch->is_closed) {
+		pthread_mutex_unlock(&ch->mutex);
+		return -1;
+	}
+	ch->buf[(ch->head + ch->count) % ch->capacity] = msg;
+	++ch->count;
+	coro_wait_list_wakeup(&ch->receivers);
+	pthread_mutex_unlock(&ch->mutex);
+	return 0;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void **msg)
+{
+	pthread_mutex_lock(&ch->mutex);
+	while (ch->count == 0 && ! ch->is_closed)
+		coro_wait_list_wait(&ch->receivers, &ch->mutex);
+	if (ch->count == 0) {
+		pthread_mutex_unlock(&ch->mutex);
+		return -1;
+	}
+	*msg = ch->buf[ch->head];
+	ch->head = (ch->head + 1) % ch->capacity;
+	--ch->count;
+	coro_wait_list_wakeup(&ch->senders);
+	pthread_mutex_unlock(&ch->mutex);
+	return 0;
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	pthread_mutex_lock(&ch->mutex);
+	ch->is_closed = true;
+	while (coro_wait_list_wakeup(&ch->senders))
+		;
+	while (coro_wait_list_wakeup(&ch->receivers))
+		;
+	pthread_mutex_unlock(&ch->mutex);
 }
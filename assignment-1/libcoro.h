@@ -2,14 +2,51 @@
 #define LIBCORO_INCLUDED
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 struct coro;
+struct coro_wq;
+struct coro_chan;
 typedef int (*coro_f)(void *);
 
-/** Make current context scheduler. */
+enum {
+	/** Stack size of coroutines created by coro_new(). */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+};
+
+/**
+ * Make current context scheduler. The scheduler and all its
+ * coroutines belong to the calling thread - other threads can
+ * have own independent schedulers.
+ */
 void
 coro_sched_init(void);
 
+/**
+ * Make current context scheduler of @a thread_count threads: the
+ * calling one and @a thread_count - 1 new worker threads. New
+ * coroutines are put on the least loaded thread, and idle threads
+ * steal ready coroutines from the others, so a coroutine can be
+ * resumed on another thread than it yielded on. The calling thread
+ * runs coroutines only inside coro_sched_wait().
+ */
+void
+coro_sched_init_mt(int thread_count);
+
+/**
+ * Stop the worker threads and free the scheduler of the current
+ * thread. All its coroutines should be deleted by then.
+ */
+void
+coro_sched_destroy(void);
+
+/** Number of threads of the current thread's scheduler. */
+int
+coro_sched_thread_count(void);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
  * if no coroutines.
@@ -28,6 +65,15 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with an explicit stack size. It is
+ * rounded up to a power of 2 pages. Stacks are reserved with a
+ * guard page below them, committed lazily, and reused after
+ * coro_delete() via a cache of free stacks.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -35,6 +81,17 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/** Usable stack size of the coroutine in bytes. */
+size_t
+coro_stack_size(const struct coro *c);
+
+/**
+ * Peak stack usage of the coroutine in bytes, with a page
+ * granularity. Valid until the coroutine is deleted.
+ */
+size_t
+coro_stack_usage(const struct coro *c);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
@@ -47,4 +104,188 @@ coro_delete(struct coro *c);
 void
 coro_yield(void);
 
+/**
+ * Yield, if the current coroutine has used up its time slice.
+ * The check is cheap enough to be called from hot loops, and it
+ * is a nop outside of coroutines. Returns true, if the coroutine
+ * has yielded.
+ *
+ * The ready coroutines are run the earliest deadline first. A
+ * coroutine gets its deadline when it becomes ready: now + its
+ * latency. The slice is the latency shared among the ready
+ * coroutines, and ends not later than the earliest deadline.
+ */
+bool
+coro_yield_if_expired(void);
+
+/**
+ * Set the target latency of the current thread's scheduler - how
+ * long a ready coroutine can wait for the CPU, if the others yield
+ * on coro_yield_if_expired(). The default is 10ms.
+ */
+void
+coro_sched_set_latency(uint64_t usec);
+
+/**
+ * Set own latency of @a c instead of the scheduler's one. 0 resets
+ * it to the scheduler's.
+ */
+void
+coro_set_latency(struct coro *c, uint64_t usec);
+
+/**
+ * Time in microseconds the coroutine has been running, not
+ * counting the time it was ready or suspended.
+ */
+uint64_t
+coro_work_time(const struct coro *c);
+
+/**
+ * Profile of a coroutine, collected by the scheduler on each
+ * switch. Times are in microseconds, by the monotonic clock.
+ */
+struct coro_stats {
+	/** Time spent running. */
+	uint64_t work_time;
+	/** Time spent ready or suspended since the creation. */
+	uint64_t wait_time;
+	/** Longest run without a switch. */
+	uint64_t max_slice;
+	/** Longest wait of a ready coroutine for the CPU. */
+	uint64_t max_latency;
+	long long switch_count;
+	/** Usable stack size and its high-water mark, bytes. */
+	size_t stack_size;
+	size_t stack_usage;
+};
+
+/** Get the profile of a running or finished coroutine. */
+void
+coro_stats(const struct coro *c, struct coro_stats *stats);
+
+/** Print the profile of a coroutine in one line. */
+void
+coro_stats_dump(const struct coro *c, FILE *out);
+
+/**
+ * Suspend the current coroutine until somebody calls
+ * coro_wakeup() on it. Other coroutines run meanwhile. If there
+ * are none, the thread sleeps.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Make a suspended coroutine ready to run. Can be called from any
+ * thread. A wakeup of a coroutine, which is not suspended yet,
+ * makes its next coro_suspend() return immediately.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Put the current coroutine to sleep for @a usec microseconds.
+ * Outside of a coroutine it is a plain sleep.
+ */
+void
+coro_sleep(uint64_t usec);
+
+/**
+ * Same as read(), but only the current coroutine waits for the
+ * data, not the whole thread. Pipes, sockets and other pollable
+ * fds are waited for in the scheduler's event loop. Regular files
+ * are read by helper threads. Only one coroutine may wait on a
+ * given fd at a time.
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t count);
+
+/**
+ * Same as write(), but blocks only the current coroutine. Writes
+ * into pollable fds can be partial, like with O_NONBLOCK.
+ */
+ssize_t
+coro_write(int fd, const void *buf, size_t count);
+
+/**
+ * Create a wait queue - a list of coroutines waiting for some
+ * condition, like a condition variable for threads.
+ */
+struct coro_wq *
+coro_wq_new(void);
+
+/** Delete a wait queue. It should not have waiters. */
+void
+coro_wq_delete(struct coro_wq *wq);
+
+/**
+ * Lock the wait queue. The lock should also protect the
+ * condition the coroutines wait for, if coroutines can run on
+ * several threads. It must not be held across a yield.
+ */
+void
+coro_wq_lock(struct coro_wq *wq);
+
+void
+coro_wq_unlock(struct coro_wq *wq);
+
+/**
+ * Suspend the current coroutine in the queue until a wakeup.
+ * Must be called with the queue locked. The lock is released
+ * while the coroutine sleeps, and is taken again on return.
+ * The condition should be rechecked after the return.
+ */
+void
+coro_wq_wait(struct coro_wq *wq);
+
+/** Wake up the longest waiting coroutine, if any. */
+void
+coro_wq_wakeup(struct coro_wq *wq);
+
+/** Wake up all the waiting coroutines. */
+void
+coro_wq_wakeup_all(struct coro_wq *wq);
+
+/**
+ * Create a bounded FIFO channel of pointers holding up to
+ * @a capacity messages.
+ */
+struct coro_chan *
+coro_chan_new(size_t capacity);
+
+/** Delete a channel. It should not have waiters. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Send a message, waiting for free space while the channel is
+ * full.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed.
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *msg);
+
+/**
+ * Receive a message, waiting for it while the channel is empty.
+ * @retval 0 Success, the message is in @a msg.
+ * @retval -1 The channel is closed and empty.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **msg);
+
+/**
+ * Close the channel. Pending and future sends fail, receives get
+ * the remaining messages and then fail.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
+
+/**
+ * Name of the context switch backend libcoro is built with:
+ * "asm-x86_64", "asm-aarch64" or "ucontext".
+ */
+const char *
+coro_switch_backend(void);
+
 #endif /* LIBCORO_INCLUDED */
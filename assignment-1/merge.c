@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "libcoro.h"
+#include "merge.h"
+
+/** Key of an exhausted source, greater than any number. */
+#define MERGE_KEY_END INT64_MAX
+
+struct merge_tree {
+	struct merge_src *srcs;
+	int count;
+	/**
+	 * Current number of each source. 64 bits fit the end marker
+	 * and keep the comparisons free of special cases.
+	 */
+	int64_t *keys;
+	/**
+	 * nodes[0] is the winner - the source with the smallest key.
+	 * nodes[1, count) is a complete binary tree, each node keeps
+	 * the loser of the match played in it. Source i is the leaf
+	 * count + i.
+	 */
+	int *nodes;
+};
+
+static int64_t
+merge_src_key(struct merge_src *src)
+{
+	if (src->pos == src->end &&
+	    (src->refill == NULL || ! src->refill(src) ||
+	     src->pos == src->end))
+		return MERGE_KEY_END;
+	return *src->pos;
+}
+
+struct merge_tree *
+merge_tree_new(struct merge_src *srcs, int count)
+{
+	struct merge_tree *tree = malloc(sizeof(*tree));
+	if (tree == NULL)
+		return NULL;
+	int size = count > 0 ? count : 1;
+	tree->srcs = srcs;
+	tree->count = count;
+	tree->keys = malloc(size * sizeof(tree->keys[0]));
+	tree->nodes = malloc(size * sizeof(tree->nodes[0]));
+	/* Winners of the matches, only to build the tree. */
+	int *winners = malloc(2 * size * sizeof(winners[0]));
+	if (tree->keys == NULL || tree->nodes == NULL || winners == NULL) {
+		free(winners);
+		merge_tree_delete(tree);
+		return NULL;
+	}
+	if (count == 0) {
+		tree->keys[0] = MERGE_KEY_END;
+		tree->nodes[0] = 0;
+		free(winners);
+		return tree;
+	}
+	for (int i = 0; i < count; ++i) {
+		tree->keys[i] = merge_src_key(&srcs[i]);
+		winners[count + i] = i;
+	}
+	for (int node = count - 1; node > 0; --node) {
+		int a = winners[2 * node];
+		int b = winners[2 * node + 1];
+		bool is_a_less = tree->keys[a] <= tree->keys[b];
+		winners[node] = is_a_less ? a : b;
+		tree->nodes[node] = is_a_less ? b : a;
+	}
+	tree->nodes[0] = count > 1 ? winners[1] : 0;
+	free(winners);
+	return tree;
+}
+
+void
+merge_tree_delete(struct merge_tree *tree)
+{
+	free(tree->keys);
+	free(tree->nodes);
+	free(tree);
+}
+
+size_t
+merge_tree_next(struct merge_tree *tree, int *out, size_t size)
+{
+	int64_t *keys = tree->keys;
+	int *nodes = tree->nodes;
+	int count = tree->count;
+	int winner = nodes[0];
+	size_t n = 0;
+	while (n < size && keys[winner] != MERGE_KEY_END) {
+		struct merge_src *src = &tree->srcs[winner];
+		out[n++] = *src->pos++;
+		/* Refills happen only once per block. */
+		if (src->pos == src->end)
+			keys[winner] = merge_src_key(src);
+		else
+			keys[winner] = *src->pos;
+		/* Replay the matches on the path from the leaf up. */
+		for (int node = (count + winner) >> 1; node > 0; node >>= 1) {
+			int loser = nodes[node];
+			bool is_loser_less = keys[loser] < keys[winner];
+			nodes[node] = is_loser_less ? winner : loser;
+			winner = is_loser_less ? loser : winner;
+		}
+	}
+	nodes[0] = winner;
+	coro_yield_if_expired();
+	return n;
+}
@@ -0,0 +1,43 @@
+#ifndef MERGE_INCLUDED
+#define MERGE_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** A sorted sequence of integers, consumed block by block. */
+struct merge_src {
+	/** The current block. */
+	const int *pos;
+	const int *end;
+	/**
+	 * Put the next block into [pos, end), return false if the
+	 * sequence is over. NULL if the block is the only one.
+	 */
+	bool
+	(*refill)(struct merge_src *src);
+	/** Whatever the refill needs. */
+	void *ctx;
+};
+
+struct merge_tree;
+
+/**
+ * K-way merge of @a count sources with a tree of losers: each number
+ * costs log2(count) branch-free comparisons. The sources are used
+ * by pointer, so they must outlive the tree.
+ */
+struct merge_tree *
+merge_tree_new(struct merge_src *srcs, int count);
+
+void
+merge_tree_delete(struct merge_tree *tree);
+
+/**
+ * Merge up to @a size next numbers into @a out. Returns how many
+ * were merged, 0 when all the sources are over. Calls
+ * coro_yield_if_expired() once per call.
+ */
+size_t
+merge_tree_next(struct merge_tree *tree, int *out, size_t size);
+
+#endif /* MERGE_INCLUDED */
@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "output.h"
+
+enum {
+	OUTPUT_BUF_SIZE = 1024 * 1024,
+	/** "-2147483648 " is the longest number with a separator. */
+	OUTPUT_INT_MAX_LEN = 12,
+};
+
+/** "00" to "99", to print 2 digits per division. */
+static const char output_digits[] =
+	"00010203040506070809101112131415161718192021222324252627282930"
+	"31323334353637383940414243444546474849505152535455565758596061"
+	"62636465666768697071727374757677787980818283848586878889909192"
+	"93949596979899";
+
+int
+output_open(struct output *out, const char *name, enum output_format format)
+{
+	out->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out->fd < 0)
+		return -1;
+	out->format = format;
+	if (format == OUTPUT_PACKED) {
+		out->buf = NULL;
+		out->size = 0;
+		out->capacity = 0;
+		out->file = fdopen(out->fd, "w");
+		if (out->file != NULL &&
+		    pack_writer_create(&out->pack, out->file) == 0)
+			return 0;
+		int save_errno = errno;
+		if (out->file != NULL)
+			fclose(out->file);
+		else
+			close(out->fd);
+		errno = save_errno;
+		return -1;
+	}
+	out->file = NULL;
+	out->buf = malloc(OUTPUT_BUF_SIZE);
+	if (out->buf == NULL) {
+		close(out->fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	out->size = 0;
+	out->capacity = OUTPUT_BUF_SIZE;
+	return 0;
+}
+
+/** Write all of the iovecs, retrying on short writes. */
+static int
+output_writev(int fd, struct iovec *iov, int count)
+{
+	while (count > 0) {
+		ssize_t rc = writev(fd, iov, count);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (count > 0 && (size_t) rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return 0;
+}
+
+static int
+output_flush(struct output *out)
+{
+	struct iovec iov = {out->buf, out->size};
+	out->size = 0;
+	return output_writev(out->fd, &iov, 1);
+}
+
+/** Print "%d " into @a dst, return the length. */
+static inline size_t
+output_itoa(char *dst, int value)
+{
+	/* Room for a fixed size copy from any start of the number. */
+	char tmp[OUTPUT_INT_MAX_LEN * 2];
+	char *end = tmp + OUTPUT_INT_MAX_LEN;
+	char *p = end;
+	*--p = ' ';
+	uint32_t v = value < 0 ? 0 - (uint32_t) value : (uint32_t) value;
+	while (v >= 100) {
+		uint32_t i = (v % 100) * 2;
+		v /= 100;
+		p -= 2;
+		memcpy(p, &output_digits[i], 2);
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, &output_digits[v * 2], 2);
+	} else {
+		*--p = (char) ('0' + v);
+	}
+	if (value < 0)
+		*--p = '-';
+	size_t len = end - p;
+	/* The buffer always has OUTPUT_INT_MAX_LEN bytes free. */
+	memcpy(dst, p, OUTPUT_INT_MAX_LEN);
+	return len;
+}
+
+static int
+output_ints_binary(struct output *out, const int *arr, size_t count)
+{
+	size_t size = count * sizeof(int);
+	if (out->size + size <= out->capacity) {
+		memcpy(out->buf + out->size, arr, size);
+		out->size += size;
+		return 0;
+	}
+	struct iovec iov[2] = {
+		{out->buf, out->size},
+		{(void *) arr, size},
+	};
+	out->size = 0;
+	return output_writev(out->fd, iov, 2);
+}
+
+int
+output_ints(struct output *out, const int *arr, size_t count)
+{
+	if (out->format == OUTPUT_PACKED)
+		return pack_write(&out->pack, arr, count);
+	if (out->format == OUTPUT_BINARY)
+		return output_ints_binary(out, arr, count);
+	for (size_t i = 0; i < count; ++i) {
+		if (out->size + OUTPUT_INT_MAX_LEN > out->capacity &&
+		    output_flush(out) != 0)
+			return -1;
+		out->size += output_itoa(out->buf + out->size, arr[i]);
+	}
+	return 0;
+}
+
+int
+output_close(struct output *out)
+{
+	if (out->format == OUTPUT_PACKED) {
+		int rc = pack_writer_finish(&out->pack);
+		int save_errno = errno;
+		if (fclose(out->file) != 0 && rc == 0) {
+			rc = -1;
+			save_errno = errno;
+		}
+		errno = save_errno;
+		return rc;
+	}
+	int rc = output_flush(out);
+	int save_errno = errno;
+	if (close(out->fd) != 0 && rc == 0) {
+		rc = -1;
+		save_errno = errno;
+	}
+	free(out->buf);
+	errno = save_errno;
+	return rc;
+}
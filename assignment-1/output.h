@@ -0,0 +1,47 @@
+#ifndef OUTPUT_INCLUDED
+#define OUTPUT_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "pack.h"
+
+enum output_format {
+	/** Each number followed by a space, like "%d ". */
+	OUTPUT_TEXT,
+	/** Native int32 values as is. */
+	OUTPUT_BINARY,
+	/** Delta encoded blocks of pack.h, for sorted numbers. */
+	OUTPUT_PACKED,
+};
+
+/** Buffered writer of integers. */
+struct output {
+	int fd;
+	enum output_format format;
+	char *buf;
+	size_t size;
+	size_t capacity;
+	/** OUTPUT_PACKED writes through a stdio stream of fd. */
+	FILE *file;
+	struct pack_writer pack;
+};
+
+/** Create or truncate the file. Returns 0, or -1 and errno. */
+int
+output_open(struct output *out, const char *name, enum output_format format);
+
+/**
+ * Append numbers. Text is formatted into the buffer, flushed with
+ * write() when it is full. Big binary blocks are written together
+ * with the buffered data by one writev() without copying. Returns
+ * 0, or -1 and errno.
+ */
+int
+output_ints(struct output *out, const int *arr, size_t count);
+
+/** Flush and close the file, even on error. Returns 0 or -1. */
+int
+output_close(struct output *out);
+
+#endif /* OUTPUT_INCLUDED */
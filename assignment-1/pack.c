@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pack.h"
+
+enum {
+	/** "PKRN" */
+	PACK_MAGIC = 0x4e524b50,
+	/** First number, bit width. */
+	PACK_BLOCK_HEADER_SIZE = 5,
+	/** Deltas of a block at 32 bits, with a tail for 8 byte loads. */
+	PACK_PAYLOAD_MAX = PACK_BLOCK_SIZE * 4 + 8,
+};
+
+struct pack_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint64_t count;
+	uint64_t index_offset;
+};
+
+/** Bits needed for @a v, 0 for 0. */
+static inline int
+pack_width(uint32_t v)
+{
+	return v == 0 ? 0 : 32 - __builtin_clz(v);
+}
+
+static inline size_t
+pack_payload_size(size_t count, int width)
+{
+	return ((count - 1) * width + 7) / 8;
+}
+
+/** Encode a block, return its size. */
+static size_t
+pack_encode(const int *arr, size_t count, char *dst)
+{
+	uint32_t max_delta = 0;
+	for (size_t i = 1; i < count; ++i)
+		max_delta |= (uint32_t) arr[i] - (uint32_t) arr[i - 1];
+	int width = pack_width(max_delta);
+	int32_t first = arr[0];
+	memcpy(dst, &first, sizeof(first));
+	dst[4] = (char) width;
+	char *p = dst + PACK_BLOCK_HEADER_SIZE;
+	uint64_t acc = 0;
+	int bits = 0;
+	for (size_t i = 1; i < count; ++i) {
+		acc |= (uint64_t) ((uint32_t) arr[i] - (uint32_t) arr[i - 1]) << bits;
+		bits += width;
+		while (bits >= 8) {
+			*p++ = (char) acc;
+			acc >>= 8;
+			bits -= 8;
+		}
+	}
+	if (bits > 0)
+		*p++ = (char) acc;
+	return p - dst;
+}
+
+/**
+ * Decode @a count numbers. The payload must have 8 readable bytes
+ * past its end: each delta is taken with an unaligned 8 byte load
+ * and a shift, without branches.
+ */
+static void
+pack_decode(int32_t first, int width, const char *payload, size_t count,
+	    int *out)
+{
+	uint64_t mask = (1ULL << width) - 1;
+	uint32_t v = (uint32_t) first;
+	out[0] = first;
+	for (size_t i = 1; i < count; ++i) {
+		size_t bit = (i - 1) * width;
+		uint64_t word;
+		memcpy(&word, payload + bit / 8, sizeof(word));
+		v += (uint32_t) ((word >> (bit % 8)) & mask);
+		out[i] = (int) v;
+	}
+}
+
+int
+pack_writer_create(struct pack_writer *w, FILE *file)
+{
+	w->file = file;
+	w->start = ftell(file);
+	if (w->start < 0)
+		return -1;
+	w->count = 0;
+	w->offset = sizeof(struct pack_header);
+	w->buf_count = 0;
+	w->blocks = NULL;
+	w->block_count = 0;
+	w->block_capacity = 0;
+	/* The header is written again when the counts are known. */
+	struct pack_header header = {0};
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		return -1;
+	return 0;
+}
+
+static int
+pack_flush_block(struct pack_writer *w)
+{
+	if (w->block_count == w->block_capacity) {
+		size_t capacity = w->block_capacity * 2;
+		if (capacity == 0)
+			capacity = 64;
+		struct pack_block *blocks = realloc(w->blocks,
+						    capacity * sizeof(blocks[0]));
+		if (blocks == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		w->blocks = blocks;
+		w->block_capacity = capacity;
+	}
+	char data[PACK_BLOCK_HEADER_SIZE + PACK_PAYLOAD_MAX];
+	size_t size = pack_encode(w->buf, w->buf_count, data);
+	if (fwrite(data, 1, size, w->file) != size)
+		return -1;
+	struct pack_block *block = &w->blocks[w->block_count++];
+	block->first = w->buf[0];
+	block->size = size;
+	block->offset = w->offset;
+	w->offset += size;
+	w->count += w->buf_count;
+	w->buf_count = 0;
+	return 0;
+}
+
+int
+pack_write(struct pack_writer *w, const int *arr, size_t count)
+{
+	while (count > 0) {
+		size_t n = PACK_BLOCK_SIZE - w->buf_count;
+		if (n > count)
+			n = count;
+		memcpy(w->buf + w->buf_count, arr, n * sizeof(int));
+		w->buf_count += n;
+		arr += n;
+		count -= n;
+		if (w->buf_count == PACK_BLOCK_SIZE && pack_flush_block(w) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+void
+pack_writer_destroy(struct pack_writer *w)
+{
+	free(w->blocks);
+	w->blocks = NULL;
+}
+
+int
+pack_writer_finish(struct pack_writer *w)
+{
+	int rc = -1;
+	if (w->buf_count > 0 && pack_flush_block(w) != 0)
+		goto finish;
+	if (fwrite(w->blocks, sizeof(w->blocks[0]), w->block_count,
+		   w->file) != w->block_count)
+		goto finish;
+	struct pack_header header = {
+		.magic = PACK_MAGIC,
+		.block_size = PACK_BLOCK_SIZE,
+		.count = w->count,
+		.index_offset = w->offset,
+	};
+	long end = w->start + w->offset + w->block_count * sizeof(w->blocks[0]);
+	if (fseek(w->file, w->start, SEEK_SET) != 0 ||
+	    fwrite(&header, sizeof(header), 1, w->file) != 1 ||
+	    fseek(w->file, end, SEEK_SET) != 0 ||
+	    fflush(w->file) != 0)
+		goto finish;
+	rc = 0;
+finish:
+	pack_writer_destroy(w);
+	return rc;
+}
+
+int
+pack_reader_create(struct pack_reader *r, FILE *file)
+{
+	r->file = file;
+	r->start = ftell(file);
+	r->blocks = NULL;
+	r->block_count = 0;
+	struct pack_header header;
+	if (r->start < 0)
+		return -1;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    header.magic != PACK_MAGIC ||
+	    header.block_size != PACK_BLOCK_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	r->count = header.count;
+	r->index_offset = header.index_offset;
+	r->left = header.count;
+	return 0;
+}
+
+void
+pack_reader_destroy(struct pack_reader *r)
+{
+	free(r->blocks);
+	r->blocks = NULL;
+}
+
+size_t
+pack_read(struct pack_reader *r, int *out, size_t capacity)
+{
+	size_t total = 0;
+	while (r->left > 0 && capacity - total >= PACK_BLOCK_SIZE) {
+		size_t count = r->left < PACK_BLOCK_SIZE ? r->left :
+			       PACK_BLOCK_SIZE;
+		char header[PACK_BLOCK_HEADER_SIZE];
+		char payload[PACK_PAYLOAD_MAX];
+		if (fread(header, sizeof(header), 1, r->file) != 1)
+			goto error;
+		int32_t first;
+		memcpy(&first, header, sizeof(first));
+		int width = header[4];
+		if (width < 0 || width > 32)
+			goto error;
+		size_t size = pack_payload_size(count, width);
+		if (size > 0 && fread(payload, size, 1, r->file) != 1)
+			goto error;
+		pack_decode(first, width, payload, count, out + total);
+		total += count;
+		r->left -= count;
+	}
+	return total;
+error:
+	if (! ferror(r->file))
+		errno = EINVAL;
+	return total;
+}
+
+static int
+pack_load_index(struct pack_reader *r)
+{
+	size_t count = (r->count + PACK_BLOCK_SIZE - 1) / PACK_BLOCK_SIZE;
+	r->blocks = malloc((count > 0 ? count : 1) * sizeof(r->blocks[0]));
+	if (r->blocks == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (fseek(r->file, r->start + r->index_offset, SEEK_SET) != 0)
+		return -1;
+	if (fread(r->blocks, sizeof(r->blocks[0]), count, r->file) != count) {
+		if (! ferror(r->file))
+			errno = EINVAL;
+		return -1;
+	}
+	r->block_count = count;
+	return 0;
+}
+
+int
+pack_reader_seek(struct pack_reader *r, int value)
+{
+	if (r->blocks == NULL && pack_load_index(r) != 0)
+		return -1;
+	/* The first block starting at value or above. */
+	size_t lo = 0;
+	size_t hi = r->block_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (r->blocks[mid].first < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* The previous block can end with the numbers >= value too. */
+	if (lo > 0)
+		--lo;
+	if (lo == r->block_count) {
+		r->left = 0;
+		return 0;
+	}
+	if (fseek(r->file, r->start + r->blocks[lo].offset, SEEK_SET) != 0)
+		return -1;
+	r->left = r->count - (uint64_t) lo * PACK_BLOCK_SIZE;
+	return 0;
+}
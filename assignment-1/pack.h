@@ -0,0 +1,110 @@
+#ifndef PACK_INCLUDED
+#define PACK_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Compact file format for sorted runs of integers. A file is:
+ *
+ * - a header: magic, count of the numbers, offset of the index;
+ * - blocks of PACK_BLOCK_SIZE numbers, the last one can be shorter.
+ *   A block is its first number as is, a bit width, and the deltas
+ *   between the next numbers packed with that width. Sorted data
+ *   has small deltas, so a number takes a few bits instead of 32;
+ * - the index: the first number and the offset of each block, to
+ *   seek by value without decoding the file.
+ *
+ * The values are in the native byte order, the files are temporary
+ * or read on the same machine.
+ */
+
+enum {
+	PACK_BLOCK_SIZE = 128,
+};
+
+/** An index entry, as it is on disk. */
+struct pack_block {
+	int32_t first;
+	/** Encoded size of the block. */
+	uint32_t size;
+	/** Offset from the file start. */
+	uint64_t offset;
+};
+
+struct pack_writer {
+	FILE *file;
+	/** Offset of the file start, the writer can append. */
+	long start;
+	uint64_t count;
+	/** Offset of the next block from the start. */
+	uint64_t offset;
+	int buf[PACK_BLOCK_SIZE];
+	int buf_count;
+	struct pack_block *blocks;
+	size_t block_count;
+	size_t block_capacity;
+};
+
+/**
+ * Start a packed file at the current position of @a file. Returns
+ * 0, or -1 and errno.
+ */
+int
+pack_writer_create(struct pack_writer *w, FILE *file);
+
+/** Append sorted numbers. Returns 0, or -1 and errno. */
+int
+pack_write(struct pack_writer *w, const int *arr, size_t count);
+
+/**
+ * Write the last block, the index and the header, and free the
+ * writer. The file is not closed. Returns 0, or -1 and errno.
+ */
+int
+pack_writer_finish(struct pack_writer *w);
+
+/** Free the writer after an error, without finishing the file. */
+void
+pack_writer_destroy(struct pack_writer *w);
+
+struct pack_reader {
+	FILE *file;
+	long start;
+	uint64_t count;
+	uint64_t index_offset;
+	/** Numbers not read yet. */
+	uint64_t left;
+	/** Loaded by the first pack_reader_seek(). */
+	struct pack_block *blocks;
+	size_t block_count;
+};
+
+/**
+ * Open a packed file from the current position of @a file. Returns
+ * 0, or -1 and errno, EINVAL for a file of another format.
+ */
+int
+pack_reader_create(struct pack_reader *r, FILE *file);
+
+void
+pack_reader_destroy(struct pack_reader *r);
+
+/**
+ * Decode the next whole blocks into @a out, @a capacity must be at
+ * least PACK_BLOCK_SIZE. Returns the count of the numbers, 0 at the
+ * end of the file. On error @a left stays above 0 and errno is set.
+ */
+size_t
+pack_read(struct pack_reader *r, int *out, size_t capacity);
+
+/**
+ * Move to the block where the numbers not less than @a value start.
+ * The numbers read next can still have a few smaller ones from the
+ * same block. Returns 0, or -1 and errno.
+ */
+int
+pack_reader_seek(struct pack_reader *r, int value);
+
+#endif /* PACK_INCLUDED */
@@ -0,0 +1,67 @@
+/*
+ * Print a file written with --packed as text, like output.txt is
+ * without it. With @a min the numbers less than it are skipped by
+ * the block index, without decoding the file before them.
+ *
+ * $> make pack_cat
+ * $> ./pack_cat file [min] > output.txt
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "output.h"
+#include "pack.h"
+
+enum {
+	BUF_SIZE = 16 * 1024,
+};
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		printf("Usage: %s file [min]\n", argv[0]);
+		return 1;
+	}
+	FILE *f = fopen(argv[1], "r");
+	struct pack_reader r;
+	if (f == NULL || pack_reader_create(&r, f) != 0) {
+		fprintf(stderr, "Error: can not read %s: %s\n", argv[1],
+			strerror(errno));
+		return 1;
+	}
+	bool is_min = argc > 2;
+	int min = is_min ? atoi(argv[2]) : 0;
+	if (is_min && pack_reader_seek(&r, min) != 0) {
+		fprintf(stderr, "Error: can not seek %s: %s\n", argv[1],
+			strerror(errno));
+		return 1;
+	}
+	struct output out;
+	if (output_open(&out, "/dev/stdout", OUTPUT_TEXT) != 0) {
+		fprintf(stderr, "Error: can not write: %s\n", strerror(errno));
+		return 1;
+	}
+	int *buf = malloc(BUF_SIZE * sizeof(int));
+	size_t n;
+	while ((n = pack_read(&r, buf, BUF_SIZE)) > 0) {
+		size_t skip = 0;
+		while (is_min && skip < n && buf[skip] < min)
+			++skip;
+		output_ints(&out, buf + skip, n - skip);
+	}
+	int rc = 0;
+	if (r.left != 0) {
+		fprintf(stderr, "Error: can not read %s: %s\n", argv[1],
+			strerror(errno));
+		rc = 1;
+	}
+	if (output_close(&out) != 0) {
+		fprintf(stderr, "Error: can not write: %s\n", strerror(errno));
+		rc = 1;
+	}
+	free(buf);
+	pack_reader_destroy(&r);
+	fclose(f);
+	return rc;
+}
@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "libcoro.h"
+#include "parse.h"
+
+enum {
+	/** Input bytes parsed between coro_yield_if_expired() calls. */
+	PARSE_CHUNK = 64 * 1024,
+	/** First read size for the files which can not be mapped. */
+	PARSE_READ_SIZE = 64 * 1024,
+};
+
+static int
+parse_buf_read(struct parse_buf *buf, int fd)
+{
+	size_t capacity = PARSE_READ_SIZE;
+	size_t size = 0;
+	char *data = malloc(capacity);
+	if (data == NULL)
+		return -1;
+	while (true) {
+		if (size == capacity) {
+			capacity *= 2;
+			char *new_data = realloc(data, capacity);
+			if (new_data == NULL) {
+				free(data);
+				return -1;
+			}
+			data = new_data;
+		}
+		ssize_t rc = coro_read(fd, data + size, capacity - size);
+		if (rc < 0) {
+			free(data);
+			return -1;
+		}
+		if (rc == 0)
+			break;
+		size += rc;
+	}
+	buf->data = data;
+	buf->size = size;
+	buf->released = 0;
+	buf->is_mapped = false;
+	return 0;
+}
+
+int
+parse_buf_open(struct parse_buf *buf, const char *name)
+{
+	return parse_buf_open_range(buf, name, 0, SIZE_MAX);
+}
+
+int
+parse_buf_open_range(struct parse_buf *buf, const char *name, size_t begin,
+		     size_t end)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+				  0);
+		if (data != MAP_FAILED) {
+			/*
+			 * Page faults block the whole thread, so start the
+			 * readahead of the entire range right away. Only of
+			 * the range: chunks of a big file are opened each
+			 * by its own reader.
+			 */
+			size_t size = st.st_size;
+			size_t page_size = sysconf(_SC_PAGESIZE);
+			begin = begin < size ? begin / page_size * page_size :
+				size;
+			end = end < size ? end : size;
+			if (begin < end) {
+				madvise((char *) data + begin, end - begin,
+					MADV_SEQUENTIAL);
+				madvise((char *) data + begin, end - begin,
+					MADV_WILLNEED);
+			}
+			close(fd);
+			buf->data = data;
+			buf->size = size;
+			buf->released = begin;
+			buf->is_mapped = true;
+			return 0;
+		}
+	}
+	int rc = parse_buf_read(buf, fd);
+	int save_errno = errno;
+	close(fd);
+	errno = save_errno;
+	return rc;
+}
+
+void
+parse_buf_release(struct parse_buf *buf, const char *pos)
+{
+	if (! buf->is_mapped)
+		return;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t offset = (pos - buf->data) / page_size * page_size;
+	if (offset <= buf->released)
+		return;
+	madvise((char *) buf->data + buf->released, offset - buf->released,
+		MADV_DONTNEED);
+	buf->released = offset;
+}
+
+void
+parse_buf_close(struct parse_buf *buf)
+{
+	if (buf->is_mapped)
+		munmap((void *) buf->data, buf->size);
+	else
+		free((void *) buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+}
+
+static inline bool
+parse_is_space(char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool
+parse_is_digit(char c)
+{
+	return (unsigned char) (c - '0') < 10;
+}
+
+/** Length of the digit sequence at @a p. */
+static inline size_t
+parse_digit_count(const char *p, const char *end)
+{
+#ifdef __SSE2__
+	/*
+	 * Numbers are up to 10 digits, so one 16 byte load almost
+	 * always finds the end of the number without a branch per
+	 * character.
+	 */
+	if (end - p >= 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *) p);
+		__m128i ge = _mm_cmpgt_epi8(s, _mm_set1_epi8('0' - 1));
+		__m128i le = _mm_cmplt_epi8(s, _mm_set1_epi8('9' + 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(ge, le));
+		if (mask != 0xffff)
+			return __builtin_ctz(~mask);
+	}
+#endif
+	const char *d = p;
+	while (d < end && parse_is_digit(*d))
+		++d;
+	return d - p;
+}
+
+size_t
+parse_align(const char *data, size_t size, size_t offset)
+{
+	while (offset > 0 && offset < size && ! parse_is_space(data[offset - 1]))
+		++offset;
+	return offset;
+}
+
+size_t
+parse_ints_next(const char **pos, const char *end, int *out, size_t capacity)
+{
+	const char *p = *pos;
+	const char *chunk_end = end - p < PARSE_CHUNK ? end : p + PARSE_CHUNK;
+	size_t cnt = 0;
+	while (cnt < capacity) {
+		while (p < end && parse_is_space(*p))
+			++p;
+		if (p == end)
+			break;
+		if (p >= chunk_end) {
+			coro_yield_if_expired();
+			chunk_end = end - p < PARSE_CHUNK ? end : p + PARSE_CHUNK;
+		}
+		const char *num = p;
+		bool is_negative = false;
+		if (*num == '-' || *num == '+') {
+			is_negative = *num == '-';
+			++num;
+		}
+		size_t len = parse_digit_count(num, end);
+		if (len == 0)
+			break;
+		uint32_t value = 0;
+		for (size_t i = 0; i < len; ++i)
+			value = value * 10 + (uint32_t) (num[i] - '0');
+		p = num + len;
+		out[cnt++] = (int) (is_negative ? 0 - value : value);
+	}
+	*pos = p;
+	return cnt;
+}
+
+int *
+parse_ints(const char *data, size_t size, size_t *count)
+{
+	/* A number with a separator is 8 bytes in a typical input. */
+	size_t capacity = size / 8 + 16;
+	size_t cnt = 0;
+	int *arr = malloc(capacity * sizeof(int));
+	if (arr == NULL)
+		return NULL;
+	const char *p = data;
+	const char *end = data + size;
+	while (true) {
+		cnt += parse_ints_next(&p, end, arr + cnt, capacity - cnt);
+		if (cnt < capacity)
+			break;
+		capacity *= 2;
+		int *new_arr = realloc(arr, capacity * sizeof(int));
+		if (new_arr == NULL) {
+			free(arr);
+			return NULL;
+		}
+		arr = new_arr;
+	}
+	*count = cnt;
+	return arr;
+}
@@ -0,0 +1,72 @@
+#ifndef PARSE_INCLUDED
+#define PARSE_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Contents of an input file. */
+struct parse_buf {
+	const char *data;
+	size_t size;
+	/** Bytes in the beginning unmapped by parse_buf_release(). */
+	size_t released;
+	/** The data is mmap()ed, otherwise it is malloc()ed. */
+	bool is_mapped;
+};
+
+/**
+ * Load a file without copying: regular files are mmap()ed. Files
+ * which can not be mapped, like pipes, are read with coro_read().
+ * Returns 0 on success, -1 and errno on error.
+ */
+int
+parse_buf_open(struct parse_buf *buf, const char *name);
+
+/**
+ * Same, but only bytes [begin, end) of a mapped file are going to
+ * be parsed: the readahead is started for them only, and the pages
+ * before them are not released. @a end can be past the file end.
+ * A read file is loaded whole.
+ */
+int
+parse_buf_open_range(struct parse_buf *buf, const char *name, size_t begin,
+		     size_t end);
+
+/**
+ * Drop the mapped pages before @a pos from the memory, they are
+ * parsed already. Keeps the resident size of a sequentially parsed
+ * file bounded. Does nothing for a file which is read.
+ */
+void
+parse_buf_release(struct parse_buf *buf, const char *pos);
+
+void
+parse_buf_close(struct parse_buf *buf);
+
+/**
+ * Parse whitespace separated decimal integers from data[0, size),
+ * the data does not need a terminating zero. Parsing stops at the
+ * first character which is neither a space nor a part of a number.
+ * Calls coro_yield_if_expired() between chunks of the input.
+ * Returns a malloc()ed array, its size is stored to @a count.
+ */
+int *
+parse_ints(const char *data, size_t size, size_t *count);
+
+/**
+ * Move @a offset forward to a token start: the beginning or the end
+ * of the data, or a byte after a space. Ranges cut at aligned
+ * offsets never split a number, so they can be parsed separately.
+ */
+size_t
+parse_align(const char *data, size_t size, size_t offset);
+
+/**
+ * Parse up to @a capacity numbers from [*pos, end) into @a out and
+ * move *pos past them. Returns the count, less than @a capacity
+ * only at the end of the numbers. Yields like parse_ints().
+ */
+size_t
+parse_ints_next(const char **pos, const char *end, int *out, size_t capacity);
+
+#endif /* PARSE_INCLUDED */
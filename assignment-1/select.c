@@ -0,0 +1,113 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "select.h"
+
+enum {
+	/** First capacity of the kept numbers. */
+	SELECT_MIN_CAPACITY = 1024,
+};
+
+void
+select_create(struct select *sel, int lo, int hi, size_t limit)
+{
+	sel->lo = lo;
+	sel->hi = hi;
+	sel->limit = limit;
+	sel->data = NULL;
+	sel->count = 0;
+	sel->capacity = 0;
+}
+
+void
+select_destroy(struct select *sel)
+{
+	free(sel->data);
+	sel->data = NULL;
+	sel->count = 0;
+	sel->capacity = 0;
+}
+
+static int
+select_reserve(struct select *sel)
+{
+	if (sel->count < sel->capacity)
+		return 0;
+	size_t capacity = sel->capacity * 2;
+	if (capacity < SELECT_MIN_CAPACITY)
+		capacity = SELECT_MIN_CAPACITY;
+	if (capacity > sel->limit)
+		capacity = sel->limit;
+	int *data = realloc(sel->data, capacity * sizeof(int));
+	if (data == NULL)
+		return -1;
+	sel->data = data;
+	sel->capacity = capacity;
+	return 0;
+}
+
+static void
+select_sift_up(int *heap, size_t i)
+{
+	int v = heap[i];
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (! (heap[parent] < v))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = v;
+}
+
+/** Put @a v to the root instead of the maximum and restore the heap. */
+static void
+select_replace_top(int *heap, size_t count, int v)
+{
+	size_t i = 0;
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= count)
+			break;
+		if (child + 1 < count && heap[child] < heap[child + 1])
+			++child;
+		if (! (v < heap[child]))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = v;
+}
+
+int
+select_add(struct select *sel, const int *arr, size_t count)
+{
+	if (sel->limit == 0)
+		return 0;
+	for (size_t i = 0; i < count; ++i) {
+		int v = arr[i];
+		if (v < sel->lo || v > sel->hi)
+			continue;
+		if (sel->count < sel->limit) {
+			if (select_reserve(sel) != 0)
+				return -1;
+			sel->data[sel->count++] = v;
+			if (sel->limit != SIZE_MAX)
+				select_sift_up(sel->data, sel->count - 1);
+		} else if (v < sel->data[0]) {
+			select_replace_top(sel->data, sel->count, v);
+		}
+	}
+	return 0;
+}
+
+int *
+select_release(struct select *sel, size_t *count)
+{
+	int *data = sel->data;
+	*count = sel->count;
+	sel->data = NULL;
+	sel->count = 0;
+	sel->capacity = 0;
+	return data;
+}
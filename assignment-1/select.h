@@ -0,0 +1,39 @@
+#ifndef SELECT_INCLUDED
+#define SELECT_INCLUDED
+
+#include <stddef.h>
+
+/**
+ * Selection of numbers from a stream: the ones within [lo, hi], and
+ * of them only the @a limit smallest. The kept numbers are a max-heap
+ * while there is a limit, so a number bigger than all the kept ones
+ * costs one comparison.
+ */
+struct select {
+	int lo;
+	int hi;
+	/** Max numbers to keep, SIZE_MAX - all of them. */
+	size_t limit;
+	int *data;
+	size_t count;
+	size_t capacity;
+};
+
+void
+select_create(struct select *sel, int lo, int hi, size_t limit);
+
+void
+select_destroy(struct select *sel);
+
+/** Take the numbers. Returns 0, or -1 when out of memory. */
+int
+select_add(struct select *sel, const int *arr, size_t count);
+
+/**
+ * Take the kept numbers away, unsorted, the caller frees them.
+ * @a sel is empty after that.
+ */
+int *
+select_release(struct select *sel, size_t *count);
+
+#endif /* SELECT_INCLUDED */
@@ -1,74 +1,159 @@
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include "libcoro.h"
+#include "merge.h"
+#include "output.h"
+#include "parse.h"
+#include "select.h"
+#include "sort.h"
+#include "spill.h"
+#include "thread_pool.h"
 
 typedef struct files {
 	const char *name;
-	FILE *tmp;
+	/** The name in the reports, with the chunk number for a chunk. */
+	char *label;
+	/**
+	 * Byte range of a chunk of a big file. The bounds are aligned
+	 * with parse_align() after the file is loaded. end == 0 - the
+	 * whole file.
+	 */
+	size_t begin;
+	size_t end;
+	/** Raw file contents, passed from the reader to a sorter. */
+	struct parse_buf buf;
+	/** Sorted numbers. */
+	int *sorted;
+	int count;
 
 	struct files *next;
 } files;
 
 static files *file_queue = NULL;
 static files *queue_pointer = NULL;
+/** Coroutines can run on several threads and share the queue. */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 uint64_t target_latency;
-uint64_t* last_yield;
-uint64_t* time_taken;
 
 size_t pool_size;
 
+/** A sorted run of numbers travelling through the pipeline. */
+struct run {
+	int *data;
+	int size;
+	/** Number of pairwise merges the run is made of. */
+	int level;
+};
+
+/** Reader -> sorters, loaded files. */
+static struct coro_chan *loaded_chan;
+/** Sorters -> merger, sorted runs. */
+static struct coro_chan *sorted_chan;
+static int sorters_left;
+/** Result of the pipeline merger. */
+static struct run *final_run;
+
+/** Sort algorithm, chosen with --sort. */
+static enum sort_strategy sort_strategy = SORT_AUTO;
+
+/**
+ * --workers mode: the files are still loaded by coroutines, but
+ * sorted and merged by tasks on a thread pool of worker_count
+ * threads.
+ */
+static int worker_count;
+static struct thread_pool *thread_pool;
+
+/** A part of a file, sorted by one pool task. */
+struct part {
+	const files *file;
+	int *data;
+	size_t count;
+	enum sort_strategy strategy;
+	long time;
+	int worker;
+	struct thread_task *task;
+};
+
+static struct part **parts;
+static int part_count;
+static int part_capacity;
+static pthread_mutex_t part_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** What each pool thread did. */
+struct worker_stats {
+	int sort_count;
+	int merge_count;
+	long sort_time;
+	long merge_time;
+};
+
+static struct worker_stats worker_stats[TPOOL_MAX_THREADS];
+static int worker_next_id;
+/** Index of the pool thread in worker_stats, assigned lazily. */
+static __thread int worker_id = -1;
+
+/**
+ * Format of output.txt, chosen with --binary-output or --packed. The
+ * latter packs the spilled runs of the external mode too.
+ */
+static enum output_format output_format = OUTPUT_TEXT;
+
+/**
+ * External sort mode: the files are cut into sorted runs of at most
+ * run_capacity numbers, spilled to disk, and merged in passes, so
+ * the memory use stays within the budget. 0 - everything is sorted
+ * in memory.
+ */
+static size_t memory_budget;
+static size_t run_capacity;
+static struct spill spill;
+/** Bytes of the input files, for the throughput report. */
+static size_t input_size;
+
+/**
+ * --top and --range: only the numbers within [select_lo, select_hi]
+ * are kept, and of them only the select_limit smallest. The sorters
+ * filter the numbers while parsing, and the merge stops after
+ * select_limit of them.
+ */
+static bool is_select;
+static int select_lo = INT_MIN;
+static int select_hi = INT_MAX;
+static size_t select_limit = SIZE_MAX;
+
+enum {
+	/** Numbers merged at once. */
+	MERGE_BUF_SIZE = 16 * 1024,
+	/** Numbers parsed between releases of the input pages. */
+	PARSE_SLICE = 64 * 1024,
+	/** Files are sorted in parts of that many numbers in --workers. */
+	PART_SIZE = 1024 * 1024,
+	/** Files are cut into chunks of at least that many bytes. */
+	CHUNK_SIZE_MIN = 4 * 1024 * 1024,
+	/** Outputs shorter than that are merged by one worker. */
+	PARALLEL_MERGE_MIN = 64 * 1024,
+};
+
 long get_current_time_in_microseconds()
 {
     struct timespec tp;
-    clock_gettime(CLOCK_REALTIME, &tp);
+    clock_gettime(CLOCK_MONOTONIC, &tp);
     return (long) (tp.tv_sec * 1000000 + tp.tv_nsec / 1000);
 }
 
-void swap(int* a, int* b) 
-{ 
-    int t = *a; 
-    *a = *b; 
-    *b = t; 
-} 
-
-int partition(int* arr, int low, int high) 
-{ 
-    int pivot = arr[high];
-    int i = (low - 1);
-  
-    for (int j = low; j <= high- 1; j++) 
-    { 
-        if (arr[j] <= pivot) 
-        { 
-            i++;
-            swap(&arr[i], &arr[j]); 
-        } 
-    } 
-    swap(&arr[i + 1], &arr[high]); 
-    return (i + 1); 
-}
-
-void quick_sort(int* arr, int low, int high, int coro_id) 
-{ 
-    if (low < high) 
-    { 
-        int pi = partition(arr, low, high); 
-
-		long cur_time = get_current_time_in_microseconds();
-		if (cur_time - last_yield[coro_id] > target_latency) {
-			time_taken[coro_id] += cur_time - last_yield[coro_id];
-			coro_yield();
-			last_yield[coro_id] = get_current_time_in_microseconds();
-		}
-
-        quick_sort(arr, low, pi - 1, coro_id); 
-        quick_sort(arr, pi + 1, high, coro_id); 
-    } 
-} 
-
 void print_array(int* arr, int size) {
     for (int i = 0; i < size; i++) {
         printf("%d ", arr[i]);
@@ -76,155 +161,892 @@ void print_array(int* arr, int size) {
     printf("\n");
 }
 
-FILE* write_array_to_tmp_file(int *arr, int size) {
-    FILE *fp = tmpfile();
+static void open_file(files *file)
+{
+	size_t end = file->end != 0 ? file->end : SIZE_MAX;
+	if (parse_buf_open_range(&file->buf, file->name, file->begin,
+				 end) != 0) {
+		printf("Error: can not read %s: %s\n", file->name,
+		       strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
 
-    for (int i = 0; i < size; i++) {
-        fprintf(fp, "%d", arr[i]);
+/** The loaded bytes to parse: the whole file or its chunk. */
+static void file_range(const files *file, const char **pos, const char **end)
+{
+	const char *data = file->buf.data;
+	size_t size = file->buf.size;
+	size_t begin = 0;
+	size_t finish = size;
+	if (file->end != 0) {
+		begin = parse_align(data, size, file->begin);
+		finish = parse_align(data, size, file->end < size ? file->end : size);
+	}
+	*pos = data + begin;
+	*end = data + finish;
+}
 
-        if (i != size - 1) {
-            fprintf(fp, " ");
-        }
-    }
+/**
+ * Parse a file in one pass, loading it first unless the reader has
+ * done it already. A mapped file is not copied, and the parser
+ * yields between chunks of the input.
+ */
+static int *load_numbers(files *file, int *count)
+{
+	if (file->buf.data == NULL)
+		open_file(file);
+	const char *pos, *end;
+	file_range(file, &pos, &end);
+	size_t cnt;
+	int *numbers = parse_ints(pos, end - pos, &cnt);
+	parse_buf_close(&file->buf);
+	if (numbers == NULL) {
+		printf("Error: no memory to parse %s\n", file->label);
+		exit(EXIT_FAILURE);
+	}
+	*count = (int) cnt;
+	return numbers;
+}
 
-	rewind(fp);
-	return fp;
+/** Pick the next unsorted file, NULL if there are none. */
+static files *next_file(void)
+{
+	pthread_mutex_lock(&queue_mutex);
+	files *file = queue_pointer;
+	if (file != NULL)
+		queue_pointer = file->next;
+	pthread_mutex_unlock(&queue_mutex);
+	return file;
+}
+
+/** Print the coroutine profile, collected by libcoro. */
+static void report(int id)
+{
+	printf("coroutine %d finished: ", id);
+	coro_stats_dump(coro_this(), stdout);
+}
+
+/**
+ * Sort the numbers of one file and tell which strategy it took
+ * and how much CPU time of the coroutine it took.
+ */
+static void sort_numbers(const files *file, int *numbers, int cnt)
+{
+	uint64_t start = coro_work_time(coro_this());
+	enum sort_strategy used = sort_ints(numbers, cnt, sort_strategy);
+	uint64_t time = coro_work_time(coro_this()) - start;
+	printf("%s: %d numbers, %s sort, %.6f s\n", file->label, cnt,
+	       sort_strategy_name(used), time / 1000000.0);
 }
 
+static void push_sort_tasks(files *file);
+
 static int coroutine_func_f(void *context)
 {
-	struct coro *this = coro_this();
 	int* id = context;
 
-	last_yield[*id] = get_current_time_in_microseconds();
+	struct files *file;
+	while ((file = next_file()) != NULL) {
+		int cnt;
+		int* numbers = load_numbers(file, &cnt);
 
-	while (queue_pointer != NULL) {
-		struct files *file = queue_pointer;
-		queue_pointer = queue_pointer->next;
+		file->sorted = numbers;
+		file->count = cnt;
+		if (thread_pool != NULL)
+			push_sort_tasks(file);
+		else
+			sort_numbers(file, numbers, cnt);
+	}
 
-		FILE* fp = fopen(file->name, "r");
-		int num;
-		int cnt = 0;
-		while (fscanf(fp, "%d", &num) != EOF) {
-			cnt++;
-		}
-		int* numbers = calloc(cnt, sizeof(int));
-		rewind(fp);
+	report(*id);
+	free(context);
+	return 0;
+}
+
+/**
+ * External sort mode: cut the files into runs of run_capacity
+ * numbers, sort and spill them. The parsed part of a file is
+ * dropped from the memory every slice.
+ */
+static int external_func(void *context)
+{
+	int* id = context;
 
-		cnt = 0;
-		while (fscanf(fp, "%d", &num) != EOF) {
-			numbers[cnt++] = num;
+	int *numbers = malloc(run_capacity * sizeof(int));
+	if (numbers == NULL) {
+		printf("Error: no memory for a run of %zu numbers\n",
+		       run_capacity);
+		exit(EXIT_FAILURE);
+	}
+	struct files *file;
+	while ((file = next_file()) != NULL) {
+		open_file(file);
+		const char *pos, *end;
+		file_range(file, &pos, &end);
+		__atomic_add_fetch(&input_size, end - pos, __ATOMIC_RELAXED);
+		bool is_over = false;
+		while (!is_over) {
+			size_t cnt = 0;
+			while (cnt < run_capacity) {
+				size_t slice = run_capacity - cnt;
+				if (slice > PARSE_SLICE)
+					slice = PARSE_SLICE;
+				size_t n = parse_ints_next(&pos, end, numbers + cnt, slice);
+				parse_buf_release(&file->buf, pos);
+				cnt += n;
+				if (n < slice) {
+					is_over = true;
+					break;
+				}
+			}
+			if (cnt == 0)
+				break;
+			sort_numbers(file, numbers, cnt);
+			if (spill_add(&spill, numbers, cnt) != 0) {
+				printf("Error: can not spill %s: %s\n", file->label,
+				       strerror(errno));
+				exit(EXIT_FAILURE);
+			}
 		}
+		parse_buf_close(&file->buf);
+	}
+	free(numbers);
 
-		quick_sort(numbers, 0, cnt - 1, *id);
+	report(*id);
+	free(context);
+	return 0;
+}
 
-		file->tmp = write_array_to_tmp_file(numbers, cnt);
-		free(numbers);
+/**
+ * --top and --range mode: parse the files by slices and keep only the
+ * selected numbers, then sort them. The parsed part of a file is
+ * dropped from the memory every slice, like in the external mode.
+ */
+static int select_func(void *context)
+{
+	int* id = context;
+
+	int *slice = malloc(PARSE_SLICE * sizeof(int));
+	if (slice == NULL) {
+		printf("Error: no memory to parse\n");
+		exit(EXIT_FAILURE);
 	}
+	struct files *file;
+	while ((file = next_file()) != NULL) {
+		open_file(file);
+		const char *pos, *end;
+		file_range(file, &pos, &end);
+		struct select sel;
+		select_create(&sel, select_lo, select_hi, select_limit);
+		size_t n;
+		do {
+			n = parse_ints_next(&pos, end, slice, PARSE_SLICE);
+			parse_buf_release(&file->buf, pos);
+			if (select_add(&sel, slice, n) != 0) {
+				printf("Error: no memory to select from %s\n",
+				       file->label);
+				exit(EXIT_FAILURE);
+			}
+		} while (n == PARSE_SLICE);
+		parse_buf_close(&file->buf);
 
-	time_taken[*id] += get_current_time_in_microseconds() - last_yield[*id];
-	printf("coroutine %d finsihed with %lld switches and executing time %f seconds\n", *id, coro_switch_count(this), time_taken[*id] * 0.000001);
+		size_t cnt;
+		int *numbers = select_release(&sel, &cnt);
+		file->sorted = numbers;
+		file->count = (int) cnt;
+		sort_numbers(file, numbers, cnt);
+	}
+	free(slice);
 
+	report(*id);
 	free(context);
 	return 0;
 }
 
-int main(int argc, char **argv) {
-    long t = get_current_time_in_microseconds(); 
+/**
+ * Pipeline mode: a reader coroutine loads the files, pool_size
+ * sorters sort them, and a merger merges the sorted runs as soon
+ * as they arrive. The stages are connected by bounded channels,
+ * so a stage with nothing to do sleeps instead of spinning.
+ */
+
+static int reader_func(void *context)
+{
+	int* id = context;
+
+	struct files *file;
+	while ((file = next_file()) != NULL) {
+		open_file(file);
+		coro_chan_send(loaded_chan, file);
+	}
+	coro_chan_close(loaded_chan);
+
+	report(*id);
+	free(context);
+	return 0;
+}
+
+static int sorter_func(void *context)
+{
+	int* id = context;
+
+	void *msg;
+	while (coro_chan_recv(loaded_chan, &msg) == 0) {
+		struct files *file = msg;
+		struct run *run = malloc(sizeof(*run));
+		run->data = load_numbers(file, &run->size);
+		run->level = 0;
+
+		sort_numbers(file, run->data, run->size);
+		coro_chan_send(sorted_chan, run);
+	}
+	if (__atomic_sub_fetch(&sorters_left, 1, __ATOMIC_ACQ_REL) == 0)
+		coro_chan_close(sorted_chan);
+
+	report(*id);
+	free(context);
+	return 0;
+}
+
+/** Merge two runs into a new one, the old ones are freed. */
+static struct run *merge_runs(struct run *a, struct run *b)
+{
+	struct run *res = malloc(sizeof(*res));
+	res->size = a->size + b->size;
+	res->data = malloc((res->size + 1) * sizeof(int));
+	res->level = (a->level > b->level ? a->level : b->level) + 1;
+	int i = 0, j = 0, k = 0;
+	while (i < a->size && j < b->size) {
+		if (a->data[i] <= b->data[j])
+			res->data[k++] = a->data[i++];
+		else
+			res->data[k++] = b->data[j++];
+		if ((k & 4095) == 0)
+			coro_yield_if_expired();
+	}
+	memcpy(res->data + k, a->data + i, (a->size - i) * sizeof(int));
+	k += a->size - i;
+	memcpy(res->data + k, b->data + j, (b->size - j) * sizeof(int));
+	free(a->data);
+	free(a);
+	free(b->data);
+	free(b);
+	return res;
+}
+
+/**
+ * Merge the runs like a binary counter: two runs of the same level
+ * are merged right away. Each number then takes part in
+ * log2(file_count) merges, and most of the merging is done while
+ * the sorters are still working.
+ */
+static int merger_func(void *context)
+{
+	int* id = context;
+
+	int capacity = 16;
+	int top = 0;
+	struct run **stack = malloc(capacity * sizeof(*stack));
+	void *msg;
+	while (coro_chan_recv(sorted_chan, &msg) == 0) {
+		if (top == capacity) {
+			capacity *= 2;
+			stack = realloc(stack, capacity * sizeof(*stack));
+		}
+		stack[top++] = msg;
+		while (top >= 2 && stack[top - 1]->level == stack[top - 2]->level) {
+			stack[top - 2] = merge_runs(stack[top - 2], stack[top - 1]);
+			--top;
+		}
+	}
+	/* The smallest runs are on the top. */
+	while (top >= 2) {
+		stack[top - 2] = merge_runs(stack[top - 2], stack[top - 1]);
+		--top;
+	}
+	final_run = top == 1 ? stack[0] : NULL;
+	free(stack);
+
+	report(*id);
+	free(context);
+	return 0;
+}
+
+static void open_output(struct output *output)
+{
+	if (output_open(output, "output.txt", output_format) != 0) {
+		printf("Error: can not open output.txt: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void write_output(struct output *output, const int *arr, size_t count)
+{
+	if (output_ints(output, arr, count) != 0) {
+		printf("Error: can not write output.txt: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
 
-	pool_size = strtol(argv[2], NULL, 10);
-	target_latency = strtol(argv[1], NULL, 10) / pool_size;
+static void close_output(struct output *output)
+{
+	if (output_close(output) != 0) {
+		printf("Error: can not write output.txt: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int current_worker(void)
+{
+	if (worker_id < 0)
+		worker_id = __atomic_fetch_add(&worker_next_id, 1, __ATOMIC_RELAXED);
+	return worker_id;
+}
+
+static void *sort_task_f(void *arg)
+{
+	struct part *part = arg;
+	long start = get_current_time_in_microseconds();
+	part->strategy = sort_ints(part->data, part->count, sort_strategy);
+	part->time = get_current_time_in_microseconds() - start;
+	part->worker = current_worker();
+	worker_stats[part->worker].sort_count++;
+	worker_stats[part->worker].sort_time += part->time;
+	return NULL;
+}
+
+static void push_task(struct thread_task **task, thread_task_f func, void *arg)
+{
+	thread_task_new(task, func, arg);
+	int rc = thread_pool_push_task(thread_pool, *task);
+	if (rc != 0) {
+		printf("Error: can not push a task, error %d\n", rc);
+		exit(EXIT_FAILURE);
+	}
+}
 
-	last_yield = calloc(pool_size, sizeof(uint64_t));
-	time_taken = calloc(pool_size, sizeof(uint64_t));
+/** Split the file into parts of PART_SIZE and sort them on the pool. */
+static void push_sort_tasks(files *file)
+{
+	for (size_t begin = 0; begin < (size_t) file->count; begin += PART_SIZE) {
+		struct part *part = calloc(1, sizeof(*part));
+		part->file = file;
+		part->data = file->sorted + begin;
+		part->count = file->count - begin;
+		if (part->count > PART_SIZE)
+			part->count = PART_SIZE;
+		pthread_mutex_lock(&part_mutex);
+		if (part_count == part_capacity) {
+			part_capacity = part_capacity == 0 ? 16 : part_capacity * 2;
+			parts = realloc(parts, part_capacity * sizeof(*parts));
+		}
+		parts[part_count++] = part;
+		push_task(&part->task, sort_task_f, part);
+		pthread_mutex_unlock(&part_mutex);
+	}
+}
 
-	for (int i = 3; i < argc; i++) {
-		if (file_queue == NULL) {
-			file_queue = calloc(1, sizeof(files));
-			queue_pointer = file_queue;
+/** Wait for the sort tasks and tell how each part was sorted. */
+static void join_sort_tasks(void)
+{
+	for (int i = 0; i < part_count; i++) {
+		struct part *part = parts[i];
+		void *result;
+		thread_task_join(part->task, &result);
+		thread_task_delete(part->task);
+		printf("%s: part %zu, %zu numbers, %s sort, %.6f s, worker %d\n",
+		       part->file->label, (part->data - part->file->sorted) / PART_SIZE,
+		       part->count, sort_strategy_name(part->strategy),
+		       part->time * 0.000001, part->worker);
+	}
+}
+
+/** Number of the run elements less than or equal to @a value. */
+static size_t upper_bound(const int *arr, size_t count, long long value)
+{
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (arr[mid] <= value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Merge path for K runs: find how many numbers of each run go to
+ * the output before the position @a rank. Takes the value which is
+ * at the rank in the merged output, all the smaller numbers, and as
+ * many equal ones as needed, from the first runs.
+ */
+static void merge_path_split(size_t rank, size_t *pos)
+{
+	long long lo = INT_MIN, hi = INT_MAX;
+	while (lo < hi) {
+		long long mid = lo + (hi - lo) / 2;
+		size_t le = 0;
+		for (int i = 0; i < part_count; i++)
+			le += upper_bound(parts[i]->data, parts[i]->count, mid);
+		if (le > rank)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	size_t taken = 0;
+	for (int i = 0; i < part_count; i++) {
+		pos[i] = upper_bound(parts[i]->data, parts[i]->count, lo - 1);
+		taken += pos[i];
+	}
+	for (int i = 0; i < part_count && taken < rank; i++) {
+		size_t equal = upper_bound(parts[i]->data, parts[i]->count, lo) - pos[i];
+		if (equal > rank - taken)
+			equal = rank - taken;
+		pos[i] += equal;
+		taken += equal;
+	}
+}
+
+/** A range of the output, merged by one pool task. */
+struct slice {
+	/** Where the slice starts in each part. */
+	size_t *begin;
+	size_t *end;
+	int *out;
+	struct thread_task *task;
+};
+
+static void *merge_task_f(void *arg)
+{
+	struct slice *slice = arg;
+	long start = get_current_time_in_microseconds();
+	struct merge_src *srcs = calloc(part_count > 0 ? part_count : 1, sizeof(*srcs));
+	for (int i = 0; i < part_count; i++) {
+		srcs[i].pos = parts[i]->data + slice->begin[i];
+		srcs[i].end = parts[i]->data + slice->end[i];
+	}
+	struct merge_tree *tree = merge_tree_new(srcs, part_count);
+	int *out = slice->out;
+	size_t n;
+	while ((n = merge_tree_next(tree, out, MERGE_BUF_SIZE)) > 0)
+		out += n;
+	merge_tree_delete(tree);
+	free(srcs);
+	int id = current_worker();
+	worker_stats[id].merge_count++;
+	worker_stats[id].merge_time += get_current_time_in_microseconds() - start;
+	return NULL;
+}
+
+/**
+ * Merge the sorted parts in parallel: the output is cut into
+ * worker_count equal slices, each slice gets its ranges of the
+ * parts by the merge path, and is merged by its own task.
+ */
+static void merge_parallel(void)
+{
+	size_t total = 0;
+	for (int i = 0; i < part_count; i++)
+		total += parts[i]->count;
+	int slice_count = total < PARALLEL_MERGE_MIN ? 1 : worker_count;
+	int *out = malloc((total + 1) * sizeof(int));
+	size_t *bounds = malloc((slice_count + 1) * (part_count + 1) * sizeof(size_t));
+	struct slice *slices = calloc(slice_count, sizeof(*slices));
+	for (int j = 0; j <= slice_count; j++) {
+		size_t *pos = bounds + j * (part_count + 1);
+		if (j == slice_count) {
+			for (int i = 0; i < part_count; i++)
+				pos[i] = parts[i]->count;
+		} else if (j == 0) {
+			memset(pos, 0, part_count * sizeof(size_t));
 		} else {
-			queue_pointer->next = calloc(1, sizeof(files));
-			queue_pointer = queue_pointer->next;
+			merge_path_split(total * j / slice_count, pos);
 		}
-		queue_pointer->name = argv[i];
-		queue_pointer->next = NULL;
+	}
+	for (int j = 0; j < slice_count; j++) {
+		slices[j].begin = bounds + j * (part_count + 1);
+		slices[j].end = bounds + (j + 1) * (part_count + 1);
+		slices[j].out = out + total * j / slice_count;
+		push_task(&slices[j].task, merge_task_f, &slices[j]);
+	}
+	for (int j = 0; j < slice_count; j++) {
+		void *result;
+		thread_task_join(slices[j].task, &result);
+		thread_task_delete(slices[j].task);
 	}
 
-	queue_pointer = file_queue;
+	struct output output;
+	open_output(&output);
+	write_output(&output, out, total);
+	close_output(&output);
 
-	coro_sched_init();
+	free(slices);
+	free(bounds);
+	free(out);
+	for (int i = 0; i < part_count; i++)
+		free(parts[i]);
+	free(parts);
+}
 
-	for (int i = 0; i < pool_size; i++) {
-		int* id = calloc(1, sizeof(int));
-		*id = i;
-		coro_new(coroutine_func_f, id);
+static void report_workers(void)
+{
+	for (int i = 0; i < worker_next_id; i++) {
+		struct worker_stats *stats = &worker_stats[i];
+		printf("worker %d: %d sorts in %.6f s, %d merges in %.6f s\n", i,
+		       stats->sort_count, stats->sort_time * 0.000001,
+		       stats->merge_count, stats->merge_time * 0.000001);
 	}
+}
 
-	struct coro *c;
-	while ((c = coro_sched_wait()) != NULL) {
-		coro_delete(c);
+static void usage(const char *name)
+{
+	printf("Usage: %s [-t threads] [-p] [-s auto|pdq|radix|counting|runs] [-m bytes[K|M|G] | -w workers | [-k count] [-r lo:hi]] [-b | -z] target_latency pool_size file...\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/** Merge the sorted sources into output.txt. */
+static void merge_to_output(struct merge_src *srcs, int cnt)
+{
+	struct merge_tree *tree = merge_tree_new(srcs, cnt);
+	int *buf = malloc(MERGE_BUF_SIZE * sizeof(int));
+	if (tree == NULL || buf == NULL) {
+		printf("Error: no memory to merge %d runs\n", cnt);
+		exit(EXIT_FAILURE);
 	}
 
-	FILE **tmp_files = calloc(argc - 3, sizeof(FILE *));
+	struct output output;
+	open_output(&output);
+	/* --top needs only the beginning of the merge. */
+	size_t left = select_limit;
+	size_t n;
+	while (left > 0 && (n = merge_tree_next(tree, buf,
+			left < MERGE_BUF_SIZE ? left : MERGE_BUF_SIZE)) > 0) {
+		write_output(&output, buf, n);
+		left -= n;
+	}
+	close_output(&output);
 
-	queue_pointer = file_queue;
+	merge_tree_delete(tree);
+	free(buf);
+}
+
+/** Merge the sorted files into output.txt. */
+static void merge_files(int file_count)
+{
+	struct merge_src *srcs = calloc(file_count, sizeof(*srcs));
 	int cnt = 0;
-	while (queue_pointer != NULL) {
-		tmp_files[cnt] = queue_pointer->tmp;
-		queue_pointer = queue_pointer->next;
+	for (files *file = file_queue; file != NULL; file = file->next) {
+		srcs[cnt].pos = file->sorted;
+		srcs[cnt].end = file->sorted + file->count;
 		cnt++;
 	}
+	merge_to_output(srcs, cnt);
+	free(srcs);
+}
 
-	int* cursors = calloc(cnt, sizeof(int));
-	bool* file_processed = calloc(cnt, sizeof(bool));
-	bool merged = false;
+static double seconds_since(long start)
+{
+	return (get_current_time_in_microseconds() - start) * 0.000001;
+}
 
-	for (int i = 0; i < cnt; i++) {
-		file_processed[i] = false;
-		if (fscanf(tmp_files[i], "%d", &cursors[i]) == EOF) {
-			file_processed[i] = true;
-			fclose(tmp_files[i]);
+static void report_phase(const char *phase, size_t bytes, double seconds)
+{
+	printf("%s: %.1f MB in %.3f s, %.1f MB/s\n", phase, bytes / 1e6,
+	       seconds, seconds > 0 ? bytes / 1e6 / seconds : 0);
+}
+
+/**
+ * Merge the spilled runs: in passes of fan_in runs while there are
+ * more of them, then the rest into output.txt.
+ */
+static void merge_spill(void)
+{
+	size_t count = 0;
+	for (int i = 0; i < spill.run_count; i++)
+		count += spill.runs[i].count;
+	size_t bytes = count * sizeof(int);
+	for (int pass = 1; spill.run_count > spill.fan_in; pass++) {
+		int run_count = spill.run_count;
+		long start = get_current_time_in_microseconds();
+		if (spill_merge_pass(&spill) != 0) {
+			printf("Error: can not merge runs: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
 		}
+		char phase[64];
+		snprintf(phase, sizeof(phase), "merge pass %d, %d -> %d runs",
+			 pass, run_count, spill.run_count);
+		report_phase(phase, bytes, seconds_since(start));
+	}
+	long start = get_current_time_in_microseconds();
+	struct merge_src *srcs = spill_srcs_new(&spill);
+	if (srcs == NULL) {
+		printf("Error: no memory to merge runs\n");
+		exit(EXIT_FAILURE);
 	}
+	merge_to_output(srcs, spill.run_count);
+	spill_srcs_delete(&spill, srcs);
+	char phase[64];
+	snprintf(phase, sizeof(phase), "final merge, %d runs", spill.run_count);
+	report_phase(phase, bytes, seconds_since(start));
+}
 
-	FILE *output = fopen("output.txt", "w");
+/** Parse "lo:hi" into the --range bounds, return false on error. */
+static bool parse_range(const char *str)
+{
+	char *end;
+	errno = 0;
+	long lo = strtol(str, &end, 10);
+	if (end == str || *end != ':')
+		return false;
+	str = end + 1;
+	long hi = strtol(str, &end, 10);
+	if (end == str || *end != '\0' || errno != 0 || lo > hi ||
+	    lo < INT_MIN || hi > INT_MAX)
+		return false;
+	select_lo = lo;
+	select_hi = hi;
+	return true;
+}
 
-	while (!merged) {
-		int min_ind = argc;
-		int min = 0;
+/** Size in bytes with an optional K, M or G suffix, 0 on error. */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	unsigned long long size = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'G':
+	case 'g':
+		size *= 1024;
+		/* Fall through. */
+	case 'M':
+	case 'm':
+		size *= 1024;
+		/* Fall through. */
+	case 'K':
+	case 'k':
+		size *= 1024;
+		++end;
+		break;
+	}
+	return *end == '\0' ? size : 0;
+}
 
-		for (int ind = 0; ind < cnt; ind++) {
-			if (min_ind == argc && !file_processed[ind]) {
-				min = cursors[ind];
-				min_ind = ind;
-			} else if (cursors[ind] < min && !file_processed[ind]) {
-				min = cursors[ind];
-				min_ind = ind;
-			}
+int main(int argc, char **argv) {
+    long t = get_current_time_in_microseconds(); 
+
+	int thread_count = 1;
+	bool is_pipeline = false;
+	static const struct option options[] = {
+		{"threads", required_argument, NULL, 't'},
+		{"pipeline", no_argument, NULL, 'p'},
+		{"sort", required_argument, NULL, 's'},
+		{"memory-budget", required_argument, NULL, 'm'},
+		{"binary-output", no_argument, NULL, 'b'},
+		{"packed", no_argument, NULL, 'z'},
+		{"workers", required_argument, NULL, 'w'},
+		{"top", required_argument, NULL, 'k'},
+		{"range", required_argument, NULL, 'r'},
+		{NULL, 0, NULL, 0},
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "t:ps:m:bzw:k:r:", options, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			thread_count = strtol(optarg, NULL, 10);
+			break;
+		case 'p':
+			is_pipeline = true;
+			break;
+		case 's':
+			sort_strategy = sort_strategy_by_name(optarg);
+			if (sort_strategy == sort_strategy_MAX)
+				usage(argv[0]);
+			break;
+		case 'b':
+			if (output_format == OUTPUT_PACKED)
+				usage(argv[0]);
+			output_format = OUTPUT_BINARY;
+			break;
+		case 'z':
+			if (output_format == OUTPUT_BINARY)
+				usage(argv[0]);
+			output_format = OUTPUT_PACKED;
+			break;
+		case 'w':
+			worker_count = strtol(optarg, NULL, 10);
+			if (worker_count <= 0 || worker_count > TPOOL_MAX_THREADS)
+				usage(argv[0]);
+			break;
+		case 'm':
+			memory_budget = parse_size(optarg);
+			if (memory_budget == 0)
+				usage(argv[0]);
+			break;
+		case 'k': {
+			char *end;
+			select_limit = strtoull(optarg, &end, 10);
+			if (select_limit == 0 || *end != '\0')
+				usage(argv[0]);
+			is_select = true;
+			break;
+		}
+		case 'r':
+			if (!parse_range(optarg))
+				usage(argv[0]);
+			is_select = true;
+			break;
+		default:
+			usage(argv[0]);
 		}
+	}
+	if (argc - optind < 2 ||
+	    (is_pipeline + (memory_budget != 0) + (worker_count != 0) +
+	     is_select) > 1)
+		usage(argv[0]);
 
-		fprintf(output, "%d ", min);
+	long pool_arg = strtol(argv[optind + 1], NULL, 10);
+	if (pool_arg < 1)
+		usage(argv[0]);
+	pool_size = pool_arg;
+	target_latency = strtol(argv[optind], NULL, 10);
 
-		if (fscanf(tmp_files[min_ind], "%d", &cursors[min_ind]) == EOF) {
-			file_processed[min_ind] = true;
-			fclose(tmp_files[min_ind]);
+	/* Big files are cut into chunks to keep all the sorters busy. */
+	int chunk_max = (int) pool_size;
+	if (worker_count > chunk_max)
+		chunk_max = worker_count;
+	int file_count = 0;
+	for (int i = optind + 2; i < argc; i++) {
+		struct stat st;
+		int chunk_count = 1;
+		if (stat(argv[i], &st) == 0 && S_ISREG(st.st_mode)) {
+			chunk_count = st.st_size / CHUNK_SIZE_MIN;
+			if (chunk_count > chunk_max)
+				chunk_count = chunk_max;
+			if (chunk_count < 1)
+				chunk_count = 1;
 		}
-
-		merged = true;
-		for (int ind = 0; ind < cnt; ind++) {
-			merged = merged && file_processed[ind];
+		for (int chunk = 0; chunk < chunk_count; chunk++) {
+			files *file = calloc(1, sizeof(files));
+			if (file_queue == NULL)
+				file_queue = file;
+			else
+				queue_pointer->next = file;
+			queue_pointer = file;
+			file->name = argv[i];
+			file->label = strdup(argv[i]);
+			if (chunk_count > 1) {
+				file->begin = st.st_size * chunk / chunk_count;
+				/* The last one takes whatever the file has grown to. */
+				file->end = chunk + 1 == chunk_count ? SIZE_MAX :
+					    (size_t) (st.st_size * (chunk + 1) /
+						      chunk_count);
+				free(file->label);
+				file->label = malloc(strlen(argv[i]) + 32);
+				sprintf(file->label, "%s[%d/%d]", argv[i], chunk + 1,
+					chunk_count);
+			}
+			file_count++;
 		}
 	}
-	fclose(output);
 
-	free(tmp_files);
-	free(cursors);
-	free(file_processed);
+	queue_pointer = file_queue;
+
+	long phase_start = get_current_time_in_microseconds();
+	if (memory_budget != 0) {
+		spill_create(&spill, memory_budget,
+			     output_format == OUTPUT_PACKED);
+		/* Each sorter needs a run and a buffer of its size to sort. */
+		run_capacity = memory_budget / pool_size / (2 * sizeof(int));
+		if (run_capacity < PARSE_SLICE)
+			run_capacity = PARSE_SLICE;
+	}
+
+	if (worker_count != 0)
+		thread_pool_new(worker_count, &thread_pool);
+
+	coro_sched_init_mt(thread_count);
+	/*
+	 * libcoro splits the latency among the ready coroutines and
+	 * makes them yield in coro_yield_if_expired().
+	 */
+	coro_sched_set_latency(target_latency);
+
+	if (is_pipeline) {
+		loaded_chan = coro_chan_new(pool_size);
+		sorted_chan = coro_chan_new(pool_size);
+		sorters_left = pool_size;
+		int* id = calloc(1, sizeof(int));
+		*id = pool_size;
+		coro_new(reader_func, id);
+		id = calloc(1, sizeof(int));
+		*id = pool_size + 1;
+		coro_new(merger_func, id);
+	}
+	for (size_t i = 0; i < pool_size; i++) {
+		int* id = calloc(1, sizeof(int));
+		*id = i;
+		if (is_pipeline)
+			coro_new(sorter_func, id);
+		else if (memory_budget != 0)
+			coro_new(external_func, id);
+		else if (is_select)
+			coro_new(select_func, id);
+		else
+			coro_new(coroutine_func_f, id);
+	}
+
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		coro_delete(c);
+	}
+	coro_sched_destroy();
+
+	/*
+	 * The pipeline merges while sorting, and the workers still sort
+	 * here, so the merge phase is only the rest of the work for them.
+	 */
+	double sort_seconds = seconds_since(phase_start);
+	long merge_start = get_current_time_in_microseconds();
+	if (is_pipeline) {
+		coro_chan_delete(loaded_chan);
+		coro_chan_delete(sorted_chan);
+		struct output output;
+		open_output(&output);
+		if (final_run != NULL) {
+			write_output(&output, final_run->data, final_run->size);
+			free(final_run->data);
+			free(final_run);
+		}
+		close_output(&output);
+	} else if (thread_pool != NULL) {
+		join_sort_tasks();
+		merge_parallel();
+		thread_pool_delete(thread_pool);
+		report_workers();
+	} else if (memory_budget == 0) {
+		merge_files(file_count);
+	} else {
+		char phase[64];
+		snprintf(phase, sizeof(phase), "run formation, %d runs",
+			 spill.run_count);
+		report_phase(phase, input_size, seconds_since(phase_start));
+		merge_spill();
+		spill_destroy(&spill);
+	}
+	printf("phases: sort %.6f s, merge %.6f s\n", sort_seconds,
+	       seconds_since(merge_start));
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	printf("peak RSS %ld KB\n", ru.ru_maxrss);
 
 	queue_pointer = file_queue;
 	while (queue_pointer != NULL) {
 		files* current = queue_pointer;
 		queue_pointer = queue_pointer->next;
+		free(current->sorted);
+		free(current->label);
 		free(current);
 	}
 
@@ -232,8 +1054,5 @@ int main(int argc, char **argv) {
 
 	printf("Total time taken is %f seconds\n", t * 0.000001);
 
-	free(time_taken);
-	free(last_yield);
-
 	return 0;
 }
@@ -0,0 +1,712 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libcoro.h"
+#include "sort.h"
+#include "sort_avx2.h"
+
+enum {
+	/** Ranges shorter than that are sorted by insertion. */
+	SORT_INSERTION_THRESHOLD = 24,
+	/** Ranges longer than that take a pivot from 9 elements. */
+	SORT_NINTHER_THRESHOLD = 128,
+	/** Max moves of an insertion sort on a sorted-looking range. */
+	SORT_PARTIAL_INSERTION_LIMIT = 8,
+	/** Heap sort checks the time slice once per that many steps. */
+	SORT_YIELD_PERIOD = 4096,
+	/** Radix sort checks the time slice once per that many elements. */
+	SORT_RADIX_CHUNK = 64 * 1024,
+	/** Shorter arrays are not worth the radix sort passes. */
+	SORT_RADIX_THRESHOLD = 256,
+	/** Max value range for the counting sort, its memory is O(range). */
+	SORT_COUNTING_MAX_RANGE = 1 << 24,
+	/** Runs should be at least that long on average to be merged. */
+	SORT_RUNS_MIN_LENGTH = 64,
+	/** The data profile is checked for an early decision that often. */
+	SORT_SAMPLE_SIZE = 4096,
+	/** Shorter ranges are not worth the vector partition setup. */
+	SORT_AVX2_PARTITION_MIN = 128,
+};
+
+static pthread_once_t sort_simd_once = PTHREAD_ONCE_INIT;
+/** The CPU has AVX2 and sort_avx2_init() is done. */
+static bool sort_has_avx2;
+/** sort_pdq() uses the AVX2 kernels. */
+static bool sort_use_avx2;
+
+static void
+sort_simd_init(void)
+{
+	sort_has_avx2 = sort_avx2_init();
+	sort_use_avx2 = sort_has_avx2;
+}
+
+bool
+sort_set_simd(bool is_enabled)
+{
+	pthread_once(&sort_simd_once, sort_simd_init);
+	sort_use_avx2 = is_enabled && sort_has_avx2;
+	return sort_use_avx2;
+}
+
+static inline void
+sort_swap(int *a, int *b)
+{
+	int t = *a;
+	*a = *b;
+	*b = t;
+}
+
+static inline void
+sort_sort2(int *a, int *b)
+{
+	if (*b < *a)
+		sort_swap(a, b);
+}
+
+/** Order three elements, so as *b becomes their median. */
+static inline void
+sort_sort3(int *a, int *b, int *c)
+{
+	sort_sort2(a, b);
+	sort_sort2(b, c);
+	sort_sort2(a, b);
+}
+
+static void
+sort_insertion(int *arr, size_t count)
+{
+	for (size_t i = 1; i < count; ++i) {
+		int v = arr[i];
+		size_t j = i;
+		for (; j > 0 && v < arr[j - 1]; --j)
+			arr[j] = arr[j - 1];
+		arr[j] = v;
+	}
+}
+
+/**
+ * Insertion sort without the bound check. An element not bigger
+ * than any in the range must be right before it.
+ */
+static void
+sort_insertion_unguarded(int *arr, size_t count)
+{
+	for (size_t i = 1; i < count; ++i) {
+		int v = arr[i];
+		int *p = arr + i;
+		for (; v < p[-1]; --p)
+			*p = p[-1];
+		*p = v;
+	}
+}
+
+/**
+ * Try to insertion sort a range, but give up after a few moves.
+ * Returns true, if the range has been sorted.
+ */
+static bool
+sort_insertion_partial(int *arr, size_t count)
+{
+	size_t moves = 0;
+	for (size_t i = 1; i < count; ++i) {
+		int v = arr[i];
+		size_t j = i;
+		for (; j > 0 && v < arr[j - 1]; --j)
+			arr[j] = arr[j - 1];
+		arr[j] = v;
+		moves += i - j;
+		if (moves > SORT_PARTIAL_INSERTION_LIMIT)
+			return false;
+	}
+	return true;
+}
+
+static void
+sort_sift_down(int *arr, size_t count, size_t i)
+{
+	int v = arr[i];
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= count)
+			break;
+		if (child + 1 < count && arr[child] < arr[child + 1])
+			++child;
+		if (! (v < arr[child]))
+			break;
+		arr[i] = arr[child];
+		i = child;
+	}
+	arr[i] = v;
+}
+
+/** The fallback keeping the worst case O(N log N). */
+static void
+sort_heap(int *arr, size_t count)
+{
+	for (size_t i = count / 2; i > 0; --i)
+		sort_sift_down(arr, count, i - 1);
+	for (size_t end = count - 1; end > 0; --end) {
+		sort_swap(&arr[0], &arr[end]);
+		sort_sift_down(arr, end, 0);
+		if (end % SORT_YIELD_PERIOD == 0)
+			coro_yield_if_expired();
+	}
+}
+
+/**
+ * Check if a few evenly spaced elements of a range are ordered
+ * either way. Then the range is likely presorted, and the scalar
+ * partition is better: unlike the vector one it keeps the order
+ * for the partial insertion sorts of the parts.
+ */
+static bool
+sort_looks_presorted(const int *arr, size_t count)
+{
+	size_t step = count / 8;
+	bool is_ascending = true;
+	bool is_descending = true;
+	for (size_t i = step; i < count; i += step) {
+		is_ascending = is_ascending && arr[i - step] <= arr[i];
+		is_descending = is_descending && arr[i - step] >= arr[i];
+	}
+	return is_ascending || is_descending;
+}
+
+/**
+ * Partition around the pivot arr[0]: smaller elements go left,
+ * the others - right. Returns the final pivot position. Sets
+ * @a is_partitioned, if there was nothing to swap.
+ */
+static size_t
+sort_partition_right(int *arr, size_t count, bool *is_partitioned)
+{
+	int pivot = arr[0];
+	size_t first = 0;
+	size_t last = count;
+	/* Median selection has left an element >= pivot at the end. */
+	while (arr[++first] < pivot)
+		;
+	if (first == 1) {
+		while (first < last && ! (arr[--last] < pivot))
+			;
+	} else {
+		while (! (arr[--last] < pivot))
+			;
+	}
+	*is_partitioned = first >= last;
+	if (! *is_partitioned && sort_use_avx2 &&
+	    last - first >= SORT_AVX2_PARTITION_MIN &&
+	    ! sort_looks_presorted(arr + first, last - first + 1)) {
+		/* The scans have found the range to partition. */
+		first += sort_avx2_partition(arr + first, last - first + 1,
+					     pivot);
+		last = first;
+	}
+	while (first < last) {
+		sort_swap(&arr[first], &arr[last]);
+		while (arr[++first] < pivot)
+			;
+		while (! (arr[--last] < pivot))
+			;
+	}
+	size_t pos = first - 1;
+	arr[0] = arr[pos];
+	arr[pos] = pivot;
+	return pos;
+}
+
+/**
+ * Partition around the pivot arr[0], when it is equal to the
+ * element before the range. Nothing in the range is smaller, so
+ * the left part gets all the elements equal to the pivot, and
+ * they are done. That makes it a three-way partition for inputs
+ * with many duplicates. Returns the last pivot position.
+ */
+static size_t
+sort_partition_left(int *arr, size_t count)
+{
+	int pivot = arr[0];
+	size_t first = 0;
+	size_t last = count;
+	while (pivot < arr[--last])
+		;
+	if (last + 1 == count) {
+		while (first < last && ! (pivot < arr[++first]))
+			;
+	} else {
+		while (! (pivot < arr[++first]))
+			;
+	}
+	while (first < last) {
+		sort_swap(&arr[first], &arr[last]);
+		while (pivot < arr[--last])
+			;
+		while (! (pivot < arr[++first]))
+			;
+	}
+	arr[0] = arr[last];
+	arr[last] = pivot;
+	return last;
+}
+
+/**
+ * Move a few elements of a badly partitioned range to break the
+ * pattern which has made the pivot bad.
+ */
+static void
+sort_shuffle(int *arr, size_t count)
+{
+	if (count < SORT_INSERTION_THRESHOLD)
+		return;
+	size_t q = count / 4;
+	sort_swap(&arr[0], &arr[q]);
+	sort_swap(&arr[count - 1], &arr[count - q]);
+	if (count > SORT_NINTHER_THRESHOLD) {
+		sort_swap(&arr[1], &arr[q + 1]);
+		sort_swap(&arr[2], &arr[q + 2]);
+		sort_swap(&arr[count - 2], &arr[count - q - 1]);
+		sort_swap(&arr[count - 3], &arr[count - q - 2]);
+	}
+}
+
+/**
+ * Sort a range. @a bad_allowed is how many badly unbalanced
+ * partitions are tolerated before falling back to the heap sort.
+ * @a is_leftmost is false, if there is an element before the
+ * range, not bigger than any in it.
+ */
+static void
+sort_pdq_loop(int *arr, size_t count, int bad_allowed, bool is_leftmost)
+{
+	while (true) {
+		if (sort_use_avx2 && count <= SORT_AVX2_SMALL_MAX) {
+			sort_avx2_small(arr, count);
+			return;
+		}
+		if (count < SORT_INSERTION_THRESHOLD) {
+			if (is_leftmost)
+				sort_insertion(arr, count);
+			else
+				sort_insertion_unguarded(arr, count);
+			return;
+		}
+		/* Put the pivot to arr[0]. */
+		size_t half = count / 2;
+		if (count > SORT_NINTHER_THRESHOLD) {
+			sort_sort3(&arr[0], &arr[half], &arr[count - 1]);
+			sort_sort3(&arr[1], &arr[half - 1], &arr[count - 2]);
+			sort_sort3(&arr[2], &arr[half + 1], &arr[count - 3]);
+			sort_sort3(&arr[half - 1], &arr[half], &arr[half + 1]);
+			sort_swap(&arr[0], &arr[half]);
+		} else {
+			sort_sort3(&arr[half], &arr[0], &arr[count - 1]);
+		}
+		if (! is_leftmost && ! (arr[-1] < arr[0])) {
+			size_t pos = sort_partition_left(arr, count);
+			arr += pos + 1;
+			count -= pos + 1;
+			continue;
+		}
+
+		bool is_partitioned;
+		size_t pos = sort_partition_right(arr, count, &is_partitioned);
+		size_t left = pos;
+		size_t right = count - pos - 1;
+		coro_yield_if_expired();
+
+		if (left < count / 8 || right < count / 8) {
+			if (--bad_allowed == 0) {
+				sort_heap(arr, count);
+				return;
+			}
+			sort_shuffle(arr, left);
+			sort_shuffle(arr + pos + 1, right);
+		} else if (is_partitioned &&
+			   sort_insertion_partial(arr, left) &&
+			   sort_insertion_partial(arr + pos + 1, right)) {
+			return;
+		}
+
+		/* Recurse into the smaller part to bound the stack. */
+		if (left < right) {
+			sort_pdq_loop(arr, left, bad_allowed, is_leftmost);
+			arr += pos + 1;
+			count = right;
+			is_leftmost = false;
+		} else {
+			sort_pdq_loop(arr + pos + 1, right, bad_allowed, false);
+			count = left;
+		}
+	}
+}
+
+void
+sort_pdq(int *arr, size_t count)
+{
+	if (count < 2)
+		return;
+	pthread_once(&sort_simd_once, sort_simd_init);
+	int depth = 0;
+	for (size_t n = count; n > 1; n >>= 1)
+		++depth;
+	sort_pdq_loop(arr, count, depth, true);
+}
+
+/** Radix sort key: the sign bit is flipped to order negatives first. */
+static inline uint32_t
+sort_radix_key(int v)
+{
+	return (uint32_t) v ^ 0x80000000u;
+}
+
+void
+sort_radix(int *arr, size_t count)
+{
+	if (count < SORT_RADIX_THRESHOLD) {
+		sort_pdq(arr, count);
+		return;
+	}
+	/* Histograms of all the 4 bytes are built in one pass. */
+	size_t hist[4][256];
+	memset(hist, 0, sizeof(hist));
+	for (size_t begin = 0; begin < count; begin += SORT_RADIX_CHUNK) {
+		size_t end = begin + SORT_RADIX_CHUNK;
+		if (end > count)
+			end = count;
+		for (size_t i = begin; i < end; ++i) {
+			uint32_t key = sort_radix_key(arr[i]);
+			++hist[0][key & 0xff];
+			++hist[1][(key >> 8) & 0xff];
+			++hist[2][(key >> 16) & 0xff];
+			++hist[3][key >> 24];
+		}
+		coro_yield_if_expired();
+	}
+	int *tmp = NULL;
+	int *src = arr;
+	for (int digit = 0; digit < 4; ++digit) {
+		unsigned shift = digit * 8;
+		size_t *h = hist[digit];
+		/* All the elements have the same byte - nothing to do. */
+		if (h[(sort_radix_key(src[0]) >> shift) & 0xff] == count)
+			continue;
+		if (tmp == NULL) {
+			tmp = malloc(count * sizeof(int));
+			if (tmp == NULL) {
+				sort_pdq(arr, count);
+				return;
+			}
+		}
+		int *dst = src == arr ? tmp : arr;
+		size_t offset = 0;
+		for (int b = 0; b < 256; ++b) {
+			size_t n = h[b];
+			h[b] = offset;
+			offset += n;
+		}
+		for (size_t begin = 0; begin < count;
+		     begin += SORT_RADIX_CHUNK) {
+			size_t end = begin + SORT_RADIX_CHUNK;
+			if (end > count)
+				end = count;
+			for (size_t i = begin; i < end; ++i) {
+				int v = src[i];
+				dst[h[(sort_radix_key(v) >> shift) & 0xff]++] = v;
+			}
+			coro_yield_if_expired();
+		}
+		src = dst;
+	}
+	if (src != arr)
+		memcpy(arr, src, count * sizeof(int));
+	free(tmp);
+}
+
+/**
+ * Counting sort for values in [min, max]. Returns false, if the
+ * range is too wide or there is no memory for it.
+ */
+static bool
+sort_counting(int *arr, size_t count, int min, int max)
+{
+	uint64_t range = (uint64_t) ((int64_t) max - min) + 1;
+	if (range > SORT_COUNTING_MAX_RANGE)
+		return false;
+	uint32_t *counts = calloc(range, sizeof(counts[0]));
+	if (counts == NULL)
+		return false;
+	for (size_t begin = 0; begin < count; begin += SORT_RADIX_CHUNK) {
+		size_t end = begin + SORT_RADIX_CHUNK;
+		if (end > count)
+			end = count;
+		for (size_t i = begin; i < end; ++i)
+			++counts[(int64_t) arr[i] - min];
+		coro_yield_if_expired();
+	}
+	size_t pos = 0;
+	size_t next_check = SORT_RADIX_CHUNK;
+	for (uint64_t v = 0; v < range; ++v) {
+		for (uint32_t n = counts[v]; n > 0; --n)
+			arr[pos++] = (int) ((int64_t) v + min);
+		if (pos >= next_check) {
+			coro_yield_if_expired();
+			next_check = pos + SORT_RADIX_CHUNK;
+		}
+	}
+	free(counts);
+	return true;
+}
+
+static void
+sort_reverse(int *arr, size_t count)
+{
+	for (size_t i = 0, j = count; i + 1 < j; ++i, --j)
+		sort_swap(&arr[i], &arr[j - 1]);
+}
+
+/** Merge sorted a[0, na) and b[0, nb) into dst. */
+static void
+sort_merge2(const int *a, size_t na, const int *b, size_t nb, int *dst)
+{
+	size_t i = 0, j = 0, k = 0;
+	while (i < na && j < nb) {
+		/* Take from a on ties, to keep the merge stable. */
+		if (b[j] < a[i])
+			dst[k++] = b[j++];
+		else
+			dst[k++] = a[i++];
+		if ((k % SORT_RADIX_CHUNK) == 0)
+			coro_yield_if_expired();
+	}
+	memcpy(dst + k, a + i, (na - i) * sizeof(int));
+	k += na - i;
+	memcpy(dst + k, b + j, (nb - j) * sizeof(int));
+}
+
+/**
+ * Natural merge sort: split the array into non-descending and
+ * non-ascending runs, reverse the latter, and merge the neighbour
+ * runs pairwise until one is left. The direction of a run is set
+ * by its first two different values. Reversing equal values is
+ * fine, plain ints have no stability to keep.
+ */
+static void
+sort_runs(int *arr, size_t count)
+{
+	if (count < 2)
+		return;
+	size_t capacity = 64;
+	size_t run_count = 0;
+	size_t *bounds = malloc((capacity + 1) * sizeof(bounds[0]));
+	if (bounds == NULL) {
+		sort_pdq(arr, count);
+		return;
+	}
+	size_t begin = 0;
+	while (begin < count) {
+		size_t end = begin + 1;
+		while (end < count && arr[end] == arr[begin])
+			++end;
+		if (end < count && arr[end] < arr[begin]) {
+			while (end < count && ! (arr[end] > arr[end - 1]))
+				++end;
+			sort_reverse(arr + begin, end - begin);
+		} else {
+			while (end < count && ! (arr[end] < arr[end - 1]))
+				++end;
+		}
+		if (run_count == capacity) {
+			capacity *= 2;
+			size_t *b = realloc(bounds,
+					    (capacity + 1) * sizeof(bounds[0]));
+			if (b == NULL) {
+				free(bounds);
+				sort_pdq(arr, count);
+				return;
+			}
+			bounds = b;
+		}
+		bounds[run_count++] = begin;
+		begin = end;
+	}
+	bounds[run_count] = count;
+	if (run_count == 1) {
+		free(bounds);
+		return;
+	}
+	int *tmp = malloc(count * sizeof(int));
+	if (tmp == NULL) {
+		free(bounds);
+		sort_pdq(arr, count);
+		return;
+	}
+	int *src = arr;
+	int *dst = tmp;
+	while (run_count > 1) {
+		size_t merged = 0;
+		size_t i = 0;
+		for (; i + 1 < run_count; i += 2) {
+			size_t a = bounds[i], b = bounds[i + 1];
+			size_t c = bounds[i + 2];
+			sort_merge2(src + a, b - a, src + b, c - b, dst + a);
+			bounds[merged++] = a;
+		}
+		if (i < run_count) {
+			size_t a = bounds[i];
+			memcpy(dst + a, src + a, (count - a) * sizeof(int));
+			bounds[merged++] = a;
+		}
+		bounds[merged] = count;
+		run_count = merged;
+		int *t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != arr)
+		memcpy(arr, src, count * sizeof(int));
+	free(tmp);
+	free(bounds);
+}
+
+/** What the strategy choice is based on. */
+struct sort_profile {
+	int min;
+	int max;
+	/** Number of the runs sort_runs() would split the array in. */
+	size_t run_count;
+};
+
+static uint64_t
+sort_profile_range(const struct sort_profile *p)
+{
+	return (uint64_t) ((int64_t) p->max - p->min) + 1;
+}
+
+/**
+ * Scan the array for its value range and the run count. Both only
+ * grow, so when @a can_stop is set, the scan stops as soon as they
+ * rule out the counting sort and the runs merge. On random data
+ * it happens after the first sample.
+ */
+static void
+sort_profile(const int *arr, size_t count, bool can_stop,
+	     struct sort_profile *p)
+{
+	int min = arr[0];
+	int max = arr[0];
+	/*
+	 * Runs are counted like sort_runs() splits them. The run
+	 * direction is 0 until its first two different values.
+	 */
+	size_t run_count = 1;
+	int direction = 0;
+	size_t max_runs = count / SORT_RUNS_MIN_LENGTH;
+	uint64_t max_range = count < SORT_COUNTING_MAX_RANGE ?
+			     count : SORT_COUNTING_MAX_RANGE;
+	for (size_t begin = 1; begin < count; begin += SORT_SAMPLE_SIZE) {
+		size_t end = begin + SORT_SAMPLE_SIZE;
+		if (end > count)
+			end = count;
+		for (size_t i = begin; i < end; ++i) {
+			int v = arr[i];
+			min = v < min ? v : min;
+			max = v > max ? v : max;
+			int step = (v > arr[i - 1]) - (v < arr[i - 1]);
+			if (direction == 0) {
+				direction = step;
+			} else if (step == -direction) {
+				++run_count;
+				direction = 0;
+			}
+		}
+		p->min = min;
+		p->max = max;
+		p->run_count = run_count;
+		if (can_stop && p->run_count > max_runs &&
+		    sort_profile_range(p) > max_range)
+			return;
+	}
+	p->min = min;
+	p->max = max;
+	p->run_count = run_count;
+}
+
+static enum sort_strategy
+sort_choose_profile(const int *arr, size_t count, struct sort_profile *p)
+{
+	if (count < SORT_RADIX_THRESHOLD)
+		return SORT_PDQ;
+	sort_profile(arr, count, true, p);
+	if (p->run_count * SORT_RUNS_MIN_LENGTH <= count)
+		return SORT_RUNS;
+	uint64_t range = sort_profile_range(p);
+	if (range <= count && range <= SORT_COUNTING_MAX_RANGE)
+		return SORT_COUNTING;
+	return SORT_RADIX;
+}
+
+enum sort_strategy
+sort_choose(const int *arr, size_t count)
+{
+	struct sort_profile p;
+	return sort_choose_profile(arr, count, &p);
+}
+
+static const char *sort_strategy_strs[] = {
+	"auto", "pdq", "radix", "counting", "runs",
+};
+
+const char *
+sort_strategy_name(enum sort_strategy strategy)
+{
+	return sort_strategy_strs[strategy];
+}
+
+enum sort_strategy
+sort_strategy_by_name(const char *name)
+{
+	for (int i = 0; i < sort_strategy_MAX; ++i) {
+		if (strcmp(sort_strategy_strs[i], name) == 0)
+			return i;
+	}
+	return sort_strategy_MAX;
+}
+
+enum sort_strategy
+sort_ints(int *arr, size_t count, enum sort_strategy strategy)
+{
+	struct sort_profile p;
+	bool has_profile = false;
+	if (strategy == SORT_AUTO) {
+		strategy = sort_choose_profile(arr, count, &p);
+		has_profile = count >= SORT_RADIX_THRESHOLD;
+	}
+	switch (strategy) {
+	case SORT_COUNTING:
+		if (count == 0)
+			break;
+		if (! has_profile)
+			sort_profile(arr, count, false, &p);
+		if (sort_counting(arr, count, p.min, p.max))
+			break;
+		/* The range is too wide. */
+		strategy = SORT_RADIX;
+		sort_radix(arr, count);
+		break;
+	case SORT_RUNS:
+		sort_runs(arr, count);
+		break;
+	case SORT_RADIX:
+		sort_radix(arr, count);
+		break;
+	default:
+		strategy = SORT_PDQ;
+		sort_pdq(arr, count);
+		break;
+	}
+	return strategy;
+}
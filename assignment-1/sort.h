@@ -0,0 +1,72 @@
+#ifndef SORT_INCLUDED
+#define SORT_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Sort integers in ascending order with a pattern-defeating
+ * quicksort: O(N log N) in the worst case, O(N) on sorted,
+ * reversed and all-equal inputs, O(log N) stack depth. Calls
+ * coro_yield_if_expired() between partitions, so it can be used
+ * in coroutines as well as outside of them.
+ */
+void
+sort_pdq(int *arr, size_t count);
+
+/**
+ * Let sort_pdq() use the AVX2 kernels: a sorting network for the
+ * short ranges and a branchless vector partition. They are used by
+ * default, if the CPU has AVX2. Returns whether they are used now.
+ */
+bool
+sort_set_simd(bool is_enabled);
+
+/**
+ * Sort integers with a byte-wise LSD radix sort: up to 4 linear
+ * passes, a pass is skipped if all the elements have the same
+ * byte in it. Needs a temporary buffer of the array size. Calls
+ * coro_yield_if_expired() between passes and inside them.
+ */
+void
+sort_radix(int *arr, size_t count);
+
+/** Sort algorithms sort_ints() can use. */
+enum sort_strategy {
+	/** Choose one of the below by the data. */
+	SORT_AUTO,
+	SORT_PDQ,
+	SORT_RADIX,
+	/** Counting sort, for a value range not wider than the count. */
+	SORT_COUNTING,
+	/** Merge of the already sorted runs, for presorted data. */
+	SORT_RUNS,
+	sort_strategy_MAX,
+};
+
+/** Name of a strategy, like "radix". */
+const char *
+sort_strategy_name(enum sort_strategy strategy);
+
+/** Strategy by its name, sort_strategy_MAX if there is none. */
+enum sort_strategy
+sort_strategy_by_name(const char *name);
+
+/**
+ * Choose a strategy for the data by its value range and number of
+ * monotonic runs: the runs merge for few runs, the counting sort
+ * for a range not wider than the count, radix sort otherwise, and
+ * pdqsort for short arrays. The scan stops as soon as the answer
+ * is radix, usually after the first few thousand elements.
+ */
+enum sort_strategy
+sort_choose(const int *arr, size_t count);
+
+/**
+ * Sort integers with @a strategy, or with a chosen one for
+ * SORT_AUTO. Returns the strategy used.
+ */
+enum sort_strategy
+sort_ints(int *arr, size_t count, enum sort_strategy strategy);
+
+#endif /* SORT_INCLUDED */
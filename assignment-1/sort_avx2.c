@@ -0,0 +1,305 @@
+#include <limits.h>
+#include <stdint.h>
+#include "sort_avx2.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+ * The file is built without -mavx2, so the same binary runs on any
+ * x86 CPU. Only these functions use AVX2, and sort.c calls them
+ * after sort_avx2_init() has found it.
+ */
+#pragma GCC push_options
+#pragma GCC target("avx2,popcnt")
+#include <immintrin.h>
+
+#define SORT_AVX2_INLINE static inline __attribute__((always_inline))
+
+/**
+ * For each mask of the lanes less than the pivot: the lane indices
+ * which move them to the beginning of a vector, and the others to
+ * the end.
+ */
+static uint32_t sort_avx2_compress[256][8] __attribute__((aligned(32)));
+
+/**
+ * Order the lanes i and i ^ xor of the vector, the smaller goes to
+ * the lane with a zero bit in @a mask.
+ */
+#define SORT_AVX2_STEP(v, perm, mask) do {				\
+	__m256i p_ = (perm);						\
+	(v) = _mm256_blend_epi32(_mm256_min_epi32((v), p_),		\
+				 _mm256_max_epi32((v), p_), (mask));	\
+} while (0)
+
+SORT_AVX2_INLINE __m256i
+sort_avx2_reverse(__m256i v)
+{
+	return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(7, 6, 5, 4,
+								 3, 2, 1, 0));
+}
+
+SORT_AVX2_INLINE __m256i
+sort_avx2_xor1(__m256i v)
+{
+	return _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+SORT_AVX2_INLINE __m256i
+sort_avx2_xor2(__m256i v)
+{
+	return _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+SORT_AVX2_INLINE __m256i
+sort_avx2_xor3(__m256i v)
+{
+	return _mm256_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+SORT_AVX2_INLINE __m256i
+sort_avx2_xor4(__m256i v)
+{
+	return _mm256_permute4x64_epi64(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+/** Sort a bitonic vector. */
+SORT_AVX2_INLINE __m256i
+sort_avx2_clean(__m256i v)
+{
+	SORT_AVX2_STEP(v, sort_avx2_xor4(v), 0xF0);
+	SORT_AVX2_STEP(v, sort_avx2_xor2(v), 0xCC);
+	SORT_AVX2_STEP(v, sort_avx2_xor1(v), 0xAA);
+	return v;
+}
+
+/**
+ * Sort a vector. The bitonic network compares the mirrored lanes
+ * of the two halves first, so both halves are merged ascending and
+ * no lanes need a descending order.
+ */
+SORT_AVX2_INLINE __m256i
+sort_avx2_sort8(__m256i v)
+{
+	SORT_AVX2_STEP(v, sort_avx2_xor1(v), 0xAA);
+	SORT_AVX2_STEP(v, sort_avx2_xor3(v), 0xCC);
+	SORT_AVX2_STEP(v, sort_avx2_xor1(v), 0xAA);
+	SORT_AVX2_STEP(v, sort_avx2_reverse(v), 0xF0);
+	SORT_AVX2_STEP(v, sort_avx2_xor2(v), 0xCC);
+	SORT_AVX2_STEP(v, sort_avx2_xor1(v), 0xAA);
+	return v;
+}
+
+SORT_AVX2_INLINE void
+sort_avx2_minmax(__m256i *a, __m256i *b)
+{
+	__m256i t = *a;
+	*a = _mm256_min_epi32(t, *b);
+	*b = _mm256_max_epi32(t, *b);
+}
+
+/**
+ * Sort @a reg_count vectors as one sequence, reg_count is a power
+ * of 2 up to 8. It is a constant in each call, so the loops unroll
+ * and the vectors stay in registers.
+ */
+SORT_AVX2_INLINE void
+sort_avx2_network(__m256i *v, int reg_count)
+{
+	for (int i = 0; i < reg_count; ++i)
+		v[i] = sort_avx2_sort8(v[i]);
+	for (int k = 2; k <= reg_count; k *= 2) {
+		/* Merge the sorted blocks of k / 2 vectors pairwise. */
+		for (int b = 0; b < reg_count; b += k) {
+			for (int i = 0; i < k / 2; ++i) {
+				__m256i *lo = &v[b + i];
+				__m256i *hi = &v[b + k - 1 - i];
+				__m256i r = sort_avx2_reverse(*hi);
+				*hi = sort_avx2_reverse(_mm256_max_epi32(*lo, r));
+				*lo = _mm256_min_epi32(*lo, r);
+			}
+			for (int d = k / 4; d > 0; d /= 2) {
+				for (int i = b; i < b + k; ++i) {
+					if ((i & d) == 0)
+						sort_avx2_minmax(&v[i], &v[i + d]);
+				}
+			}
+		}
+		for (int i = 0; i < reg_count; ++i)
+			v[i] = sort_avx2_clean(v[i]);
+	}
+}
+
+/** Load the vectors, padding the lanes past @a count with INT_MAX. */
+SORT_AVX2_INLINE void
+sort_avx2_load(const int *arr, size_t count, __m256i *v, int reg_count)
+{
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i pad = _mm256_set1_epi32(INT_MAX);
+	for (int i = 0; i < reg_count; ++i) {
+		__m256i mask = _mm256_cmpgt_epi32(
+			_mm256_set1_epi32((int) count - 8 * i), lanes);
+		__m256i x = _mm256_maskload_epi32(arr + 8 * i, mask);
+		v[i] = _mm256_blendv_epi8(pad, x, mask);
+	}
+}
+
+SORT_AVX2_INLINE void
+sort_avx2_store(int *arr, size_t count, const __m256i *v, int reg_count)
+{
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	for (int i = 0; i < reg_count; ++i) {
+		__m256i mask = _mm256_cmpgt_epi32(
+			_mm256_set1_epi32((int) count - 8 * i), lanes);
+		_mm256_maskstore_epi32(arr + 8 * i, mask, v[i]);
+	}
+}
+
+#define SORT_AVX2_SMALL(reg_count) do {					\
+	__m256i v[reg_count];						\
+	sort_avx2_load(arr, count, v, reg_count);			\
+	sort_avx2_network(v, reg_count);				\
+	sort_avx2_store(arr, count, v, reg_count);			\
+} while (0)
+
+void
+sort_avx2_small(int *arr, size_t count)
+{
+	if (count <= 8)
+		SORT_AVX2_SMALL(1);
+	else if (count <= 16)
+		SORT_AVX2_SMALL(2);
+	else if (count <= 32)
+		SORT_AVX2_SMALL(4);
+	else
+		SORT_AVX2_SMALL(8);
+}
+
+/**
+ * Partition a vector: the lanes less than the pivot are stored to
+ * @a left, the others to the end of [right - 8, right). Both stores
+ * write the whole vector. Returns the count of the smaller lanes.
+ */
+SORT_AVX2_INLINE int
+sort_avx2_partition_vec(__m256i v, __m256i pivot, int *left, int *right)
+{
+	__m256i lt = _mm256_cmpgt_epi32(pivot, v);
+	int mask = _mm256_movemask_ps(_mm256_castsi256_ps(lt));
+	__m256i perm = _mm256_load_si256(
+		(const __m256i *) sort_avx2_compress[mask]);
+	v = _mm256_permutevar8x32_epi32(v, perm);
+	_mm256_storeu_si256((__m256i *) left, v);
+	_mm256_storeu_si256((__m256i *) (right - 8), v);
+	return _mm_popcnt_u32(mask);
+}
+
+size_t
+sort_avx2_partition(int *arr, size_t count, int pivot)
+{
+	if (count < 16) {
+		size_t less = 0;
+		for (size_t i = 0; i < count; ++i) {
+			if (arr[i] < pivot) {
+				int t = arr[i];
+				arr[i] = arr[less];
+				arr[less++] = t;
+			}
+		}
+		return less;
+	}
+	/*
+	 * The first and the last vectors are kept aside, that frees 16
+	 * slots. Each step reads a vector from the side with less free
+	 * space, so both sides have at least 8 free slots, and writes
+	 * the vector to both sides. The lanes of a wrong side land to
+	 * the free slots and are overwritten later.
+	 */
+	__m256i vpivot = _mm256_set1_epi32(pivot);
+	__m256i first = _mm256_loadu_si256((const __m256i *) arr);
+	__m256i last = _mm256_loadu_si256((const __m256i *) (arr + count - 8));
+	size_t left = 0;
+	size_t right = count;
+	size_t read_left = 8;
+	size_t read_right = count - 8;
+	while (read_right - read_left >= 8) {
+		__m256i v;
+		if (read_left - left <= right - read_right) {
+			v = _mm256_loadu_si256((const __m256i *) (arr + read_left));
+			read_left += 8;
+		} else {
+			read_right -= 8;
+			v = _mm256_loadu_si256((const __m256i *) (arr + read_right));
+		}
+		int less = sort_avx2_partition_vec(v, vpivot, arr + left,
+						   arr + right);
+		left += less;
+		right -= 8 - less;
+	}
+	/*
+	 * Up to 8 unread elements and the 2 vectors put aside fill the
+	 * rest exactly.
+	 */
+	int tail[24];
+	size_t tail_count = read_right - read_left;
+	for (size_t i = 0; i < tail_count; ++i)
+		tail[i] = arr[read_left + i];
+	_mm256_storeu_si256((__m256i *) (tail + tail_count), first);
+	_mm256_storeu_si256((__m256i *) (tail + tail_count + 8), last);
+	tail_count += 16;
+	for (size_t i = 0; i < tail_count; ++i) {
+		if (tail[i] < pivot)
+			arr[left++] = tail[i];
+		else
+			arr[--right] = tail[i];
+	}
+	return left;
+}
+
+bool
+sort_avx2_init(void)
+{
+	__builtin_cpu_init();
+	if (! __builtin_cpu_supports("avx2") ||
+	    ! __builtin_cpu_supports("popcnt"))
+		return false;
+	for (int mask = 0; mask < 256; ++mask) {
+		int pos = 0;
+		for (int i = 0; i < 8; ++i) {
+			if ((mask & (1 << i)) != 0)
+				sort_avx2_compress[mask][pos++] = i;
+		}
+		for (int i = 0; i < 8; ++i) {
+			if ((mask & (1 << i)) == 0)
+				sort_avx2_compress[mask][pos++] = i;
+		}
+	}
+	return true;
+}
+
+#pragma GCC pop_options
+
+#else /* no x86 */
+
+bool
+sort_avx2_init(void)
+{
+	return false;
+}
+
+void
+sort_avx2_small(int *arr, size_t count)
+{
+	(void) arr;
+	(void) count;
+}
+
+size_t
+sort_avx2_partition(int *arr, size_t count, int pivot)
+{
+	(void) arr;
+	(void) count;
+	(void) pivot;
+	return 0;
+}
+
+#endif /* x86 */
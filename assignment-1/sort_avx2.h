@@ -0,0 +1,33 @@
+#ifndef SORT_AVX2_INCLUDED
+#define SORT_AVX2_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** AVX2 kernels of sort_pdq(). Not for use outside of sort.c. */
+
+enum {
+	/** Max count for sort_avx2_small(). */
+	SORT_AVX2_SMALL_MAX = 64,
+};
+
+/**
+ * Check the CPU and prepare the tables. Returns false, if there is
+ * no AVX2, and then the other functions must not be called.
+ */
+bool
+sort_avx2_init(void);
+
+/** Sort up to SORT_AVX2_SMALL_MAX integers with a bitonic network. */
+void
+sort_avx2_small(int *arr, size_t count);
+
+/**
+ * Move the elements less than @a pivot to the beginning of the
+ * range, the others to the end. Returns the count of the smaller
+ * ones. The order inside the parts is arbitrary.
+ */
+size_t
+sort_avx2_partition(int *arr, size_t count, int pivot);
+
+#endif /* SORT_AVX2_INCLUDED */
@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "merge.h"
+#include "pack.h"
+#include "spill.h"
+
+enum {
+	/** Preferred read block, long enough for sequential disk reads. */
+	SPILL_BLOCK_SIZE = 1024 * 1024,
+	SPILL_MIN_BLOCK_SIZE = 4096,
+	SPILL_MAX_FAN_IN = 1024,
+};
+
+/** Reads a run back by blocks. */
+struct spill_reader {
+	FILE *tmp;
+	int *buf;
+	size_t capacity;
+	bool is_packed;
+	struct pack_reader pack;
+};
+
+/** Writes a run. */
+struct spill_writer {
+	FILE *tmp;
+	bool is_packed;
+	struct pack_writer pack;
+};
+
+void
+spill_create(struct spill *spill, size_t memory_budget, bool is_packed)
+{
+	pthread_mutex_init(&spill->mutex, NULL);
+	spill->runs = NULL;
+	spill->run_count = 0;
+	spill->run_capacity = 0;
+	/* fan_in blocks to read and one to write. */
+	size_t block_size = SPILL_BLOCK_SIZE;
+	size_t fan_in = memory_budget / block_size;
+	if (fan_in >= 3) {
+		--fan_in;
+	} else {
+		fan_in = 2;
+		block_size = memory_budget / 3;
+		if (block_size < SPILL_MIN_BLOCK_SIZE)
+			block_size = SPILL_MIN_BLOCK_SIZE;
+	}
+	if (fan_in > SPILL_MAX_FAN_IN)
+		fan_in = SPILL_MAX_FAN_IN;
+	spill->fan_in = fan_in;
+	spill->block_count = block_size / sizeof(int);
+	spill->is_packed = is_packed;
+}
+
+void
+spill_destroy(struct spill *spill)
+{
+	for (int i = 0; i < spill->run_count; ++i)
+		fclose(spill->runs[i].tmp);
+	free(spill->runs);
+	pthread_mutex_destroy(&spill->mutex);
+}
+
+/** Start a run in a new temporary file. Returns 0, or -1 and errno. */
+static int
+spill_writer_create(struct spill_writer *w, bool is_packed)
+{
+	w->tmp = tmpfile();
+	if (w->tmp == NULL)
+		return -1;
+	w->is_packed = is_packed;
+	if (is_packed && pack_writer_create(&w->pack, w->tmp) != 0) {
+		int save_errno = errno;
+		fclose(w->tmp);
+		errno = save_errno;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+spill_writer_write(struct spill_writer *w, const int *arr, size_t count)
+{
+	if (w->is_packed)
+		return pack_write(&w->pack, arr, count);
+	return fwrite(arr, sizeof(int), count, w->tmp) == count ? 0 : -1;
+}
+
+/**
+ * Finish the run and return its file. On error the file is closed,
+ * NULL is returned.
+ */
+static FILE *
+spill_writer_finish(struct spill_writer *w, bool is_ok)
+{
+	if (w->is_packed) {
+		if (is_ok)
+			is_ok = pack_writer_finish(&w->pack) == 0;
+		else
+			pack_writer_destroy(&w->pack);
+	}
+	if (is_ok)
+		return w->tmp;
+	int save_errno = errno;
+	fclose(w->tmp);
+	errno = save_errno;
+	return NULL;
+}
+
+/** Write the numbers to a new temporary file, NULL on error. */
+static FILE *
+spill_write(const int *arr, size_t count, bool is_packed)
+{
+	struct spill_writer w;
+	if (spill_writer_create(&w, is_packed) != 0)
+		return NULL;
+	bool is_ok = spill_writer_write(&w, arr, count) == 0;
+	return spill_writer_finish(&w, is_ok);
+}
+
+static int
+spill_push(struct spill *spill, FILE *tmp, size_t count)
+{
+	if (spill->run_count == spill->run_capacity) {
+		int capacity = spill->run_capacity * 2;
+		if (capacity == 0)
+			capacity = 16;
+		struct spill_run *runs = realloc(spill->runs,
+						 capacity * sizeof(runs[0]));
+		if (runs == NULL)
+			return -1;
+		spill->runs = runs;
+		spill->run_capacity = capacity;
+	}
+	spill->runs[spill->run_count].tmp = tmp;
+	spill->runs[spill->run_count].count = count;
+	++spill->run_count;
+	return 0;
+}
+
+int
+spill_add(struct spill *spill, const int *arr, size_t count)
+{
+	FILE *tmp = spill_write(arr, count, spill->is_packed);
+	if (tmp == NULL)
+		return -1;
+	pthread_mutex_lock(&spill->mutex);
+	int rc = spill_push(spill, tmp, count);
+	pthread_mutex_unlock(&spill->mutex);
+	if (rc != 0) {
+		fclose(tmp);
+		errno = ENOMEM;
+	}
+	return rc;
+}
+
+static bool
+spill_refill(struct merge_src *src)
+{
+	struct spill_reader *reader = src->ctx;
+	size_t n;
+	if (reader->is_packed)
+		n = pack_read(&reader->pack, reader->buf, reader->capacity);
+	else
+		n = fread(reader->buf, sizeof(int), reader->capacity,
+			  reader->tmp);
+	src->pos = reader->buf;
+	src->end = reader->buf + n;
+	return n > 0;
+}
+
+static void
+spill_srcs_delete_range(struct merge_src *srcs, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		struct spill_reader *reader = srcs[i].ctx;
+		if (reader != NULL) {
+			if (reader->is_packed)
+				pack_reader_destroy(&reader->pack);
+			free(reader->buf);
+		}
+		free(reader);
+	}
+	free(srcs);
+}
+
+/** Sources for the runs [begin, begin + count), NULL on error. */
+static struct merge_src *
+spill_srcs_new_range(struct spill *spill, int begin, int count)
+{
+	struct merge_src *srcs = calloc(count > 0 ? count : 1,
+					sizeof(srcs[0]));
+	if (srcs == NULL)
+		return NULL;
+	for (int i = 0; i < count; ++i) {
+		struct spill_reader *reader = malloc(sizeof(*reader));
+		srcs[i].refill = spill_refill;
+		srcs[i].ctx = reader;
+		if (reader == NULL)
+			goto error;
+		reader->tmp = spill->runs[begin + i].tmp;
+		reader->capacity = spill->block_count;
+		reader->is_packed = false;
+		reader->buf = malloc(reader->capacity * sizeof(int));
+		if (reader->buf == NULL)
+			goto error;
+		rewind(reader->tmp);
+		if (spill->is_packed) {
+			if (pack_reader_create(&reader->pack, reader->tmp) != 0)
+				goto error;
+			reader->is_packed = true;
+		}
+	}
+	return srcs;
+error:
+	spill_srcs_delete_range(srcs, count);
+	return NULL;
+}
+
+struct merge_src *
+spill_srcs_new(struct spill *spill)
+{
+	return spill_srcs_new_range(spill, 0, spill->run_count);
+}
+
+void
+spill_srcs_delete(struct spill *spill, struct merge_src *srcs)
+{
+	spill_srcs_delete_range(srcs, spill->run_count);
+}
+
+/** Merge the runs [begin, begin + count) into a new temporary file. */
+static FILE *
+spill_merge_range(struct spill *spill, int begin, int count, int *out,
+		  size_t *total)
+{
+	struct merge_src *srcs = spill_srcs_new_range(spill, begin, count);
+	if (srcs == NULL)
+		return NULL;
+	struct merge_tree *tree = merge_tree_new(srcs, count);
+	FILE *tmp = NULL;
+	struct spill_writer w;
+	if (tree == NULL || spill_writer_create(&w, spill->is_packed) != 0)
+		goto finish;
+	*total = 0;
+	bool is_ok = true;
+	size_t n;
+	while ((n = merge_tree_next(tree, out, spill->block_count)) > 0) {
+		if (spill_writer_write(&w, out, n) != 0) {
+			is_ok = false;
+			break;
+		}
+		*total += n;
+	}
+	tmp = spill_writer_finish(&w, is_ok);
+finish:
+	if (tree != NULL)
+		merge_tree_delete(tree);
+	spill_srcs_delete_range(srcs, count);
+	return tmp;
+}
+
+int
+spill_merge_pass(struct spill *spill)
+{
+	int *out = malloc(spill->block_count * sizeof(int));
+	if (out == NULL)
+		return -1;
+	int new_count = 0;
+	for (int begin = 0; begin < spill->run_count; begin += spill->fan_in) {
+		int count = spill->run_count - begin;
+		if (count > spill->fan_in)
+			count = spill->fan_in;
+		if (count == 1) {
+			spill->runs[new_count++] = spill->runs[begin];
+			continue;
+		}
+		size_t total;
+		FILE *tmp = spill_merge_range(spill, begin, count, out, &total);
+		if (tmp == NULL) {
+			/* Keep the runs consistent for spill_destroy(). */
+			int save_errno = errno;
+			for (int i = begin; i < spill->run_count; ++i)
+				spill->runs[new_count++] = spill->runs[i];
+			spill->run_count = new_count;
+			free(out);
+			errno = save_errno;
+			return -1;
+		}
+		for (int i = begin; i < begin + count; ++i)
+			fclose(spill->runs[i].tmp);
+		spill->runs[new_count].tmp = tmp;
+		spill->runs[new_count].count = total;
+		++new_count;
+	}
+	spill->run_count = new_count;
+	free(out);
+	return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef SPILL_INCLUDED
+#define SPILL_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+struct merge_src;
+
+/** A sorted run in a temporary file, as native ints or packed. */
+struct spill_run {
+	FILE *tmp;
+	size_t count;
+};
+
+/**
+ * Sorted runs on disk and their merge within a memory budget: each
+ * merged run is read by blocks, and all the blocks of one merge fit
+ * the budget together.
+ */
+struct spill {
+	pthread_mutex_t mutex;
+	struct spill_run *runs;
+	int run_count;
+	int run_capacity;
+	/** Max runs merged at once. */
+	int fan_in;
+	/** Numbers read from a run at once. */
+	size_t block_count;
+	/** The runs are in the pack.h format. */
+	bool is_packed;
+};
+
+void
+spill_create(struct spill *spill, size_t memory_budget, bool is_packed);
+
+void
+spill_destroy(struct spill *spill);
+
+/**
+ * Write a sorted run to a temporary file. Can be called from
+ * several threads. Returns 0, or -1 and errno.
+ */
+int
+spill_add(struct spill *spill, const int *arr, size_t count);
+
+/**
+ * Merge the runs by groups of fan_in into fewer, longer runs. Call
+ * until run_count is not above fan_in, then merge the rest with
+ * spill_srcs_new(). Returns 0, or -1 and errno.
+ */
+int
+spill_merge_pass(struct spill *spill);
+
+/** Sources to read all the runs by blocks, for merge_tree_new(). */
+struct merge_src *
+spill_srcs_new(struct spill *spill);
+
+void
+spill_srcs_delete(struct spill *spill, struct merge_src *srcs);
+
+#endif /* SPILL_INCLUDED */
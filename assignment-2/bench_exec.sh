@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Cost of starting short commands in the shell: runs COUNT commands
+# through it and prints the time per command. With strace installed,
+# or bench_syscalls built next to the script, prints the syscalls
+# per command too, and the execve() calls among them: without the
+# hash table each command tries each $PATH directory until the one
+# which has it. The command must not be a builtin like true or echo,
+# those run in the shell and are not spawned at all.
+#
+# $> gcc main.c -o nebash
+# $> gcc -O2 bench_syscalls.c -o bench_syscalls
+# $> ./bench_exec.sh ./nebash [count] [command]
+
+shell=${1:-./nebash}
+count=${2:-10000}
+command=${3:-sleep 0}
+
+script=$(mktemp)
+i=0
+while [ $i -lt $count ]; do
+	echo "$command"
+	i=$((i + 1))
+done > "$script"
+
+start=$(date +%s%N)
+"$shell" < "$script" > /dev/null
+end=$(date +%s%N)
+echo "$count commands: $(( (end - start) / count / 1000 )) us per command"
+
+if command -v strace > /dev/null; then
+	trace=$(mktemp)
+	strace -f -c -o "$trace" "$shell" < "$script" > /dev/null
+	# Rows are: % time, seconds, usecs/call, calls, [errors,] syscall.
+	awk -v count=$count '
+		$1 ~ /^[0-9.]+$/ && $NF != "total" { total += $4 }
+		$NF == "execve" { execve = $4; errors = NF == 6 ? $5 : 0 }
+		END {
+			printf "%.1f syscalls per command, execve %.1f, " \
+			       "failed %.1f\n", total / count,
+			       execve / count, errors / count
+		}' "$trace"
+	rm -f "$trace"
+elif [ -x "$(dirname "$0")/bench_syscalls" ]; then
+	"$(dirname "$0")/bench_syscalls" "$shell" < "$script" 2>&1 \
+		> /dev/null | awk -v count=$count '
+		/^syscalls/ {
+			printf "%.1f syscalls per command, execve %.1f, " \
+			       "failed %.1f\n", $2 / count, $4 / count,
+			       $6 / count
+		}'
+fi
+rm -f "$script"
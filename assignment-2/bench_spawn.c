@@ -0,0 +1,111 @@
+/*
+ * Latency of starting a command and waiting for it: fork() + execv()
+ * against posix_spawn() and vfork() + execv(), with the parent's heap
+ * grown to a given size. fork() copies the page tables of the whole
+ * heap, so its cost grows with the heap, while the other two do not
+ * copy them.
+ *
+ * $> gcc -O2 bench_spawn.c -o bench_spawn
+ * $> ./bench_spawn [command_count] [heap_mb...]
+ */
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static char *const true_argv[] = {"true", NULL};
+static const char *true_path = "/bin/true";
+
+long long now_ns() {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (long long)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+void run_fork() {
+  pid_t pid = fork();
+  if (pid == 0) {
+    execv(true_path, true_argv);
+    _exit(EXIT_FAILURE);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+void run_vfork() {
+  pid_t pid = vfork();
+  if (pid == 0) {
+    execv(true_path, true_argv);
+    _exit(EXIT_FAILURE);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+void run_spawn() {
+  pid_t pid;
+  if (posix_spawn(&pid, true_path, NULL, NULL, true_argv, environ) != 0) {
+    printf("Error: spawn failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+int main(int argc, char **argv) {
+  int count = argc > 1 ? atoi(argv[1]) : 2000;
+  int sizes[] = {0, 64, 512};
+  int size_count = sizeof(sizes) / sizeof(sizes[0]);
+  if (argc > 2) {
+    size_count = 0;
+    for (int i = 2; i < argc && size_count < 3; i++) {
+      sizes[size_count++] = atoi(argv[i]);
+    }
+  }
+
+  // Warm up the page cache and the allocator.
+  for (int i = 0; i < 100; i++) {
+    run_fork();
+    run_spawn();
+    run_vfork();
+  }
+  printf("%8s %14s %14s %14s\n", "heap MB", "fork us/cmd", "spawn us/cmd",
+         "vfork us/cmd");
+  for (int s = 0; s < size_count; s++) {
+    size_t size = (size_t)sizes[s] * 1024 * 1024;
+    char *heap = malloc(size > 0 ? size : 1);
+    // No huge pages, like a heap grown by small allocations.
+    madvise((void *)((unsigned long)heap & ~4095UL), size, MADV_NOHUGEPAGE);
+    // Touch the pages, so they are mapped and fork() has to copy them.
+    memset(heap, 1, size);
+
+    long long fork_time = now_ns();
+    for (int i = 0; i < count; i++) {
+      run_fork();
+    }
+    fork_time = now_ns() - fork_time;
+
+    long long spawn_time = now_ns();
+    for (int i = 0; i < count; i++) {
+      run_spawn();
+    }
+    spawn_time = now_ns() - spawn_time;
+
+    long long vfork_time = now_ns();
+    for (int i = 0; i < count; i++) {
+      run_vfork();
+    }
+    vfork_time = now_ns() - vfork_time;
+
+    printf("%8d %14.1f %14.1f %14.1f\n", sizes[s], fork_time / 1000.0 / count,
+           spawn_time / 1000.0 / count, vfork_time / 1000.0 / count);
+    free(heap);
+  }
+  return 0;
+}
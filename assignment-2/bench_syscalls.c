@@ -0,0 +1,82 @@
+/*
+ * Syscall counter for bench_exec.sh, for machines without strace:
+ * runs a command with its children under ptrace() and prints the
+ * number of syscalls, execve() calls and failed execve() calls to
+ * stderr. A failed execve() is one which did not end in an exec,
+ * like the tries of the $PATH directories without the command.
+ *
+ * $> gcc -O2 bench_syscalls.c -o bench_syscalls
+ * $> ./bench_syscalls command [arg...] < input > /dev/null
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s command [arg...]\n", argv[0]);
+    return 1;
+  }
+  pid_t child = fork();
+  if (child == 0) {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    // Wait for the tracer to set the options before the exec.
+    raise(SIGSTOP);
+    execvp(argv[1], argv + 1);
+    _exit(127);
+  }
+  int status;
+  if (child == -1 || waitpid(child, &status, 0) == -1) {
+    printf("Error: can not start %s.\n", argv[1]);
+    return 1;
+  }
+  long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK |
+                 PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE |
+                 PTRACE_O_TRACEEXEC;
+  if (ptrace(PTRACE_SETOPTIONS, child, NULL, options) == -1) {
+    printf("Error: ptrace failed.\n");
+    return 1;
+  }
+  ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+  long long syscalls = 0;
+  long long execs = 0;
+  long long exec_events = 0;
+  pid_t pid;
+  // The children are traced too, so it ends when all of them exit.
+  while ((pid = waitpid(-1, &status, __WALL)) != -1) {
+    if (!WIFSTOPPED(status)) {
+      continue;
+    }
+    int sig = WSTOPSIG(status);
+    int event = status >> 16;
+    if (sig == (SIGTRAP | 0x80)) {
+      struct __ptrace_syscall_info info;
+      if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 &&
+          info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+        syscalls++;
+        if (info.entry.nr == SYS_execve) {
+          execs++;
+        }
+      }
+      sig = 0;
+    } else if (sig == SIGTRAP && event != 0) {
+      if (event == PTRACE_EVENT_EXEC) {
+        exec_events++;
+      }
+      sig = 0;
+    } else if (sig == SIGSTOP) {
+      // The first stop of a new child, not a signal to pass on.
+      sig = 0;
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, sig);
+  }
+  // To stderr, the command's own output is usually thrown away.
+  fprintf(stderr, "syscalls %lld execve %lld failed %lld\n", syscalls,
+          execs, execs - exec_events);
+  return 0;
+}
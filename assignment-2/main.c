@@ -1,8 +1,13 @@
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 typedef struct {
@@ -260,116 +265,777 @@ char *read_line(int *len, bool* eof) {
   return buffer;
 }
 
-int main() {
-  bool eof = false;
+#define HASH_BUCKETS 64
 
-  while (!eof) {
-    char cwd[1024];
+/*
+ * Command hash table, like in bash: a command name is looked up in
+ * $PATH once, then the command is spawned by the remembered path.
+ * Without it every command tries each $PATH directory in turn.
+ */
+typedef struct hash_entry {
+  char *name;
+  char *path;
+  int hits;
+  struct hash_entry *next;
+} hash_entry;
 
-    int line_len = 0;
-    char *line = read_line(&line_len, &eof);
+hash_entry *hash_table[HASH_BUCKETS];
+// $PATH the table was filled with, the table is dropped when it changes.
+char *hash_path_env;
 
-    int commands_count = 0;
-    cmd **commands = parse_line(line, line_len, &commands_count);
+unsigned hash_bucket(const char *name) {
+  unsigned h = 5381;
+  while (*name != '\0') {
+    h = h * 33 + (unsigned char)*name++;
+  }
+  return h % HASH_BUCKETS;
+}
+
+void hash_clear() {
+  for (int i = 0; i < HASH_BUCKETS; i++) {
+    while (hash_table[i] != NULL) {
+      hash_entry *entry = hash_table[i];
+      hash_table[i] = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+    }
+  }
+}
 
-    int old_fds[2];
-    int new_fds[2];
+void hash_remove(const char *name) {
+  hash_entry **link = &hash_table[hash_bucket(name)];
+  while (*link != NULL) {
+    hash_entry *entry = *link;
+    if (strcmp(entry->name, name) == 0) {
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      return;
+    }
+    link = &entry->next;
+  }
+}
 
-    int command_pids[commands_count];
+// Find an executable in $PATH, a malloc()ed path or NULL.
+char *hash_search_path(const char *name) {
+  const char *dirs = getenv("PATH");
+  if (dirs == NULL) {
+    dirs = "/bin:/usr/bin";
+  }
+  size_t name_len = strlen(name);
+  while (true) {
+    const char *end = strchr(dirs, ':');
+    size_t dir_len = end != NULL ? (size_t)(end - dirs) : strlen(dirs);
+    char *path = malloc(dir_len + name_len + 3);
+    if (dir_len == 0) {
+      // An empty entry is the current directory.
+      strcpy(path, "./");
+    } else {
+      memcpy(path, dirs, dir_len);
+      path[dir_len] = '/';
+      path[dir_len + 1] = '\0';
+    }
+    strcat(path, name);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(path, X_OK) == 0) {
+      return path;
+    }
+    free(path);
+    if (end == NULL) {
+      return NULL;
+    }
+    dirs = end + 1;
+  }
+}
 
-    if (commands_count > 1) {
-      if (pipe(old_fds) == -1) {
-        printf("Error: pipe failed.\n");
-        exit(EXIT_FAILURE);
+/*
+ * Path to spawn a command by: the name itself if it has a slash,
+ * otherwise the remembered or a newly found one. NULL if not found.
+ */
+const char *hash_lookup(const char *name, bool count_hit) {
+  if (strchr(name, '/') != NULL) {
+    return name;
+  }
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL) {
+    path_env = "";
+  }
+  if (hash_path_env == NULL || strcmp(hash_path_env, path_env) != 0) {
+    hash_clear();
+    free(hash_path_env);
+    hash_path_env = strdup(path_env);
+  }
+
+  unsigned bucket = hash_bucket(name);
+  for (hash_entry *entry = hash_table[bucket]; entry != NULL;
+       entry = entry->next) {
+    if (strcmp(entry->name, name) == 0) {
+      if (count_hit) {
+        entry->hits++;
       }
+      return entry->path;
     }
+  }
 
-    for (int i = 0; i < commands_count; i++) {
-      if (i != commands_count - 1) {
-        if (pipe(new_fds) == -1) {
-          printf("Error: pipe failed.\n");
-          exit(EXIT_FAILURE);
+  char *path = hash_search_path(name);
+  if (path == NULL) {
+    return NULL;
+  }
+  hash_entry *entry = malloc(sizeof(hash_entry));
+  entry->name = strdup(name);
+  entry->path = path;
+  entry->hits = count_hit ? 1 : 0;
+  entry->next = hash_table[bucket];
+  hash_table[bucket] = entry;
+  return path;
+}
+
+/*
+ * Print a backslash escape of echo -e and printf, str points past the
+ * backslash. Octal is \0nnn for echo and \nnn for printf, like in bash.
+ * Returns the rest of the string, or NULL on \c which ends the output.
+ */
+const char *print_escape(const char *str, FILE *out, bool is_echo) {
+  const char *from = "\\abefnrtv";
+  const char *to = "\\\a\b\033\f\n\r\t\v";
+  const char *simple = *str != '\0' ? strchr(from, *str) : NULL;
+  if (simple != NULL) {
+    fputc(to[simple - from], out);
+    return str + 1;
+  }
+  if (*str == 'c') {
+    return NULL;
+  }
+  int base = 0;
+  int max_digits = 0;
+  if (is_echo ? *str == '0' : *str >= '0' && *str <= '7') {
+    base = 8;
+    max_digits = 3;
+    str += is_echo;
+  } else if (*str == 'x' && isxdigit((unsigned char)str[1])) {
+    base = 16;
+    max_digits = 2;
+    str++;
+  }
+  if (base == 0) {
+    fputc('\\', out);
+    return str;
+  }
+  int value = 0;
+  for (int i = 0; i < max_digits; i++) {
+    int digit = isdigit((unsigned char)*str) ? *str - '0'
+                : isxdigit((unsigned char)*str)
+                    ? tolower((unsigned char)*str) - 'a' + 10
+                    : base;
+    if (digit >= base) {
+      break;
+    }
+    value = value * base + digit;
+    str++;
+  }
+  fputc(value, out);
+  return str;
+}
+
+// Print a string with the backslash escapes of echo -e, false on \c.
+bool print_escaped(const char *str, FILE *out) {
+  while (*str != '\0') {
+    if (*str != '\\') {
+      fputc(*str++, out);
+      continue;
+    }
+    str = print_escape(str + 1, out, true);
+    if (str == NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int builtin_cd(cmd *command, FILE *out) {
+  (void)out;
+  if (chdir(command->argv[1]) == -1) {
+    printf("cd: no such file or directory: %s\n", command->argv[1]);
+    return 1;
+  }
+  return 0;
+}
+
+int builtin_exit(cmd *command, FILE *out) {
+  (void)out;
+  if (command->argc > 0) {
+    exit(atol(command->argv[1]));
+  }
+  exit(0);
+}
+
+/*
+ * The hash builtin: "hash" lists the remembered commands with their
+ * hit counts, "hash -r" forgets them, "hash name..." looks the names
+ * up without running them.
+ */
+int builtin_hash(cmd *command, FILE *out) {
+  int status = 0;
+  if (command->argc == 0) {
+    bool is_empty = true;
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+      for (hash_entry *entry = hash_table[i]; entry != NULL;
+           entry = entry->next) {
+        if (is_empty) {
+          fprintf(out, "hits\tcommand\n");
+          is_empty = false;
         }
+        fprintf(out, "%4d\t%s\n", entry->hits, entry->path);
+      }
+    }
+    if (is_empty) {
+      fprintf(out, "hash: hash table empty\n");
+    }
+  } else if (strcmp(command->argv[1], "-r") == 0) {
+    hash_clear();
+  } else {
+    for (int i = 1; i <= command->argc; i++) {
+      if (hash_lookup(command->argv[i], false) == NULL) {
+        printf("hash: %s: not found\n", command->argv[i]);
+        status = 1;
+      }
+    }
+  }
+  return status;
+}
+
+// echo [-neE] [arg...], the options are as in bash.
+int builtin_echo(cmd *command, FILE *out) {
+  bool newline = true;
+  bool escapes = false;
+  int i = 1;
+  // Only the leading words of n, e and E letters are options, "-x" is printed.
+  for (; i <= command->argc; i++) {
+    const char *arg = command->argv[i];
+    if (arg[0] != '-' || arg[1] == '\0' ||
+        strspn(arg + 1, "neE") != strlen(arg + 1)) {
+      break;
+    }
+    for (const char *c = arg + 1; *c != '\0'; c++) {
+      if (*c == 'n') {
+        newline = false;
+      } else {
+        escapes = *c == 'e';
       }
-      if (strcmp(commands[i]->name, "cd") == 0) {
-        if (chdir(commands[i]->argv[1]) == -1) {
-          printf("cd: no such file or directory: %s\n", commands[i]->argv[1]);
+    }
+  }
+  for (int first = i; i <= command->argc; i++) {
+    if (i > first) {
+      fputc(' ', out);
+    }
+    if (!escapes) {
+      fputs(command->argv[i], out);
+    } else if (!print_escaped(command->argv[i], out)) {
+      return 0;
+    }
+  }
+  if (newline) {
+    fputc('\n', out);
+  }
+  return 0;
+}
+
+int builtin_pwd(cmd *command, FILE *out) {
+  (void)command;
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL) {
+    printf("pwd: %s\n", strerror(errno));
+    return 1;
+  }
+  fprintf(out, "%s\n", cwd);
+  free(cwd);
+  return 0;
+}
+
+int builtin_true(cmd *command, FILE *out) {
+  (void)command;
+  (void)out;
+  return 0;
+}
+
+int builtin_false(cmd *command, FILE *out) {
+  (void)command;
+  (void)out;
+  return 1;
+}
+
+// An integer operand of test, false if it is not one.
+bool test_integer(const char *str, long long *value) {
+  char *end;
+  errno = 0;
+  *value = strtoll(str, &end, 10);
+  if (end == str || *end != '\0' || errno != 0) {
+    printf("test: %s: integer expression expected\n", str);
+    return false;
+  }
+  return true;
+}
+
+// Status of "test op operand": 0 if true, 1 if false, 2 on an error.
+int test_unary(const char *op, const char *operand) {
+  if (strcmp(op, "-n") == 0) {
+    return operand[0] == '\0';
+  }
+  if (strcmp(op, "-z") == 0) {
+    return operand[0] != '\0';
+  }
+  struct stat st;
+  bool exists = stat(operand, &st) == 0;
+  if (op[0] == '-' && op[1] != '\0' && op[2] == '\0') {
+    switch (op[1]) {
+    case 'e':
+      return !exists;
+    case 'f':
+      return !(exists && S_ISREG(st.st_mode));
+    case 'd':
+      return !(exists && S_ISDIR(st.st_mode));
+    case 's':
+      return !(exists && st.st_size > 0);
+    case 'r':
+      return access(operand, R_OK) != 0;
+    case 'w':
+      return access(operand, W_OK) != 0;
+    case 'x':
+      return access(operand, X_OK) != 0;
+    case 'h':
+    case 'L':
+      return !(lstat(operand, &st) == 0 && S_ISLNK(st.st_mode));
+    }
+  }
+  printf("test: %s: unary operator expected\n", op);
+  return 2;
+}
+
+// Status of "test left op right" like test_unary(), -1 if op is not binary.
+int test_binary(const char *left, const char *op, const char *right) {
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+    return strcmp(left, right) != 0;
+  }
+  if (strcmp(op, "!=") == 0) {
+    return strcmp(left, right) == 0;
+  }
+  const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  int op_index = 0;
+  while (op_index < 6 && strcmp(op, ops[op_index]) != 0) {
+    op_index++;
+  }
+  if (op_index == 6) {
+    return -1;
+  }
+  long long a;
+  long long b;
+  if (!test_integer(left, &a) || !test_integer(right, &b)) {
+    return 2;
+  }
+  bool result[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+  return !result[op_index];
+}
+
+/*
+ * Status of a test expression of argc words, as POSIX defines it by
+ * the word count: "! expr", "string", "op operand", "left op right".
+ * The -a, -o and the parentheses are not supported.
+ */
+int test_expression(const char **argv, int argc) {
+  if (argc == 3) {
+    int status = test_binary(argv[0], argv[1], argv[2]);
+    if (status != -1) {
+      return status;
+    }
+  }
+  if (argc > 1 && strcmp(argv[0], "!") == 0) {
+    int status = test_expression(argv + 1, argc - 1);
+    return status == 2 ? 2 : !status;
+  }
+  switch (argc) {
+  case 0:
+    return 1;
+  case 1:
+    return argv[0][0] == '\0';
+  case 2:
+    return test_unary(argv[0], argv[1]);
+  }
+  printf("test: too many arguments\n");
+  return 2;
+}
+
+// test expr and [ expr ].
+int builtin_test(cmd *command, FILE *out) {
+  (void)out;
+  int argc = command->argc;
+  if (strcmp(command->name, "[") == 0) {
+    if (argc == 0 || strcmp(command->argv[argc], "]") != 0) {
+      printf("[: missing `]'\n");
+      return 2;
+    }
+    argc--;
+  }
+  return test_expression(command->argv + 1, argc);
+}
+
+// A numeric argument of printf: a number or 'c for the code of c.
+long long printf_integer(const char *str, int *status) {
+  if (str[0] == '\'' || str[0] == '"') {
+    return (unsigned char)str[1];
+  }
+  if (str[0] == '\0') {
+    return 0;
+  }
+  char *end;
+  errno = 0;
+  long long value = strtoll(str, &end, 0);
+  if (*end != '\0' || errno != 0) {
+    printf("printf: %s: invalid number\n", str);
+    *status = 1;
+  }
+  return value;
+}
+
+/*
+ * printf format [arg...]: the conversions are %d %i %o %u %x %X %c %s
+ * and %b with the flags, the width and the precision, but not "*".
+ * The format is used again while there are arguments left, and the
+ * missing ones are empty strings and zeros.
+ */
+int builtin_printf(cmd *command, FILE *out) {
+  if (command->argc == 0) {
+    printf("printf: usage: printf format [arguments]\n");
+    return 2;
+  }
+  const char *format = command->argv[1];
+  int arg = 2;
+  int status = 0;
+  while (true) {
+    int first_arg = arg;
+    const char *p = format;
+    while (*p != '\0') {
+      if (*p == '\\') {
+        p = print_escape(p + 1, out, false);
+        if (p == NULL) {
+          return status;
         }
         continue;
-      } else if (strcmp(commands[i]->name, "exit") == 0 && commands_count == 1) {
-        if (commands[i]->argc > 0) {
-          exit(atol(commands[i]->argv[1]));
-        } else {
-          exit(0);
+      }
+      if (*p != '%') {
+        fputc(*p++, out);
+        continue;
+      }
+      if (p[1] == '%') {
+        fputc('%', out);
+        p += 2;
+        continue;
+      }
+      size_t len = 1 + strspn(p + 1, "-+ #0");
+      len += strspn(p + len, "0123456789");
+      if (p[len] == '.') {
+        len++;
+        len += strspn(p + len, "0123456789");
+      }
+      char conversion = p[len];
+      char spec[32];
+      if (conversion == '\0' || strchr("diouxXcsb", conversion) == NULL ||
+          len + 4 > sizeof(spec)) {
+        printf("printf: %.*s: invalid format\n", (int)len + 1, p);
+        return 1;
+      }
+      memcpy(spec, p, len);
+      const char *value = arg <= command->argc ? command->argv[arg++] : "";
+      p += len + 1;
+      switch (conversion) {
+      case 'd':
+      case 'i':
+        sprintf(spec + len, "ll%c", conversion);
+        fprintf(out, spec, printf_integer(value, &status));
+        break;
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        sprintf(spec + len, "ll%c", conversion);
+        fprintf(out, spec, (unsigned long long)printf_integer(value, &status));
+        break;
+      case 'c':
+        sprintf(spec + len, "c");
+        if (value[0] != '\0') {
+          fprintf(out, spec, value[0]);
+        }
+        break;
+      case 's':
+        sprintf(spec + len, "s");
+        fprintf(out, spec, value);
+        break;
+      case 'b':
+        if (!print_escaped(value, out)) {
+          return status;
         }
         break;
       }
+    }
+    if (arg > command->argc || arg == first_arg) {
+      return status;
+    }
+  }
+}
 
-      command_pids[i] = fork();
+typedef int (*builtin_func)(cmd *command, FILE *out);
 
-      if (command_pids[i] < 0) {
-        printf("Error: fork failed.\n");
-        exit(EXIT_FAILURE);
-      } else if (command_pids[i] == 0) { // child process
-        const char *const *const_argv = (const char *const *)commands[i]->argv;
-        char *const *argv = (char *const *)const_argv;
-
-        if (commands[i]->redirect) {
-          int fd;
-
-          if (commands[i]->redirect_appending) {
-            fd = open(commands[i]->redirect_file, O_WRONLY | O_CREAT | O_APPEND,
-                      S_IRUSR | S_IWUSR); // open file for writing
-          } else {
-            fd = open(commands[i]->redirect_file, O_WRONLY | O_CREAT | O_TRUNC,
-                      S_IRUSR | S_IWUSR); // open file for writing
-          }
-
-          if (fd == -1) {
-            printf("Error: redirect failed.\n");
-            exit(EXIT_FAILURE);
-          }
-
-          dup2(fd, STDOUT_FILENO); // redirect stdout to file
-          close(fd);
-        }
+/*
+ * Commands which run in the shell itself instead of being spawned, a
+ * fork and an exec per "echo" or "test" is most of their cost. A
+ * builtin writes to @out, which is the shell's stdout, the redirect
+ * file or the pipe to the next stage. is_standalone builtins are run
+ * only as the whole line, in a pipeline they are spawned as commands.
+ * is_silent builtins write nothing to @out, so they run in the stage
+ * order: "cd dir | ls" lists dir, like before the builtins.
+ */
+typedef struct {
+  const char *name;
+  builtin_func func;
+  bool is_standalone;
+  bool is_silent;
+} builtin;
 
-        if (i > 0) {
-          dup2(old_fds[0], STDIN_FILENO);
-          close(old_fds[0]);
-          close(old_fds[1]);
-        }
+builtin builtins[] = {
+    {"cd", builtin_cd, false, true},
+    {"exit", builtin_exit, true, true},
+    {"hash", builtin_hash, false, false},
+    {"echo", builtin_echo, false, false},
+    {"pwd", builtin_pwd, false, false},
+    {"true", builtin_true, false, true},
+    {"false", builtin_false, false, true},
+    {"test", builtin_test, false, true},
+    {"[", builtin_test, false, true},
+    {"printf", builtin_printf, false, false},
+};
 
-        if (i != commands_count - 1) {
-          close(new_fds[0]);
-          dup2(new_fds[1], STDOUT_FILENO);
-          close(new_fds[1]);
-        }
+const builtin *find_builtin(const char *name, int commands_count) {
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (strcmp(builtins[i].name, name) == 0) {
+      if (builtins[i].is_standalone && commands_count > 1) {
+        return NULL;
+      }
+      return &builtins[i];
+    }
+  }
+  return NULL;
+}
 
-        execvp(commands[i]->name, argv);
+// Open the output redirect of a command, -1 with an error printed.
+int open_redirect(cmd *command) {
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  flags |= command->redirect_appending ? O_APPEND : O_TRUNC;
+  int fd = open(command->redirect_file, flags, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    printf("Error: redirect failed.\n");
+    fflush(stdout);
+  }
+  return fd;
+}
 
-        exit(EXIT_FAILURE);
-      } else { // parent process
-        if (i > 0) {
-          close(old_fds[0]);
-          close(old_fds[1]);
-        }
+// A pipe between two stages. The spawned stages get its ends by
+// dup2() only, so the ends do not leak to the other stages by exec.
+void make_pipe(int fds[2]) {
+  if (pipe(fds) == -1) {
+    printf("Error: pipe failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
 
-        if (i != commands_count - 1) {
-          old_fds[0] = new_fds[0];
-          old_fds[1] = new_fds[1];
+/*
+ * Run a builtin in the shell. The output goes to pipe_fd if it is not
+ * -1, else to the redirect file, else to the shell's stdout. The file
+ * is created even when the pipe takes the output, like for a spawned
+ * stage. pipe_fd is closed after.
+ */
+int run_builtin(const builtin *b, cmd *command, int pipe_fd) {
+  int fd = pipe_fd;
+  if (command->redirect) {
+    int redirect_fd = open_redirect(command);
+    if (redirect_fd == -1) {
+      if (pipe_fd != -1) {
+        close(pipe_fd);
+      }
+      return 1;
+    }
+    if (fd == -1) {
+      fd = redirect_fd;
+    } else {
+      close(redirect_fd);
+    }
+  }
+  FILE *out = stdout;
+  if (fd != -1) {
+    out = fdopen(fd, "w");
+    if (out == NULL) {
+      close(fd);
+      return 1;
+    }
+  }
+  int status = b->func(command, out);
+  if (out != stdout) {
+    fclose(out);
+  }
+  fflush(stdout);
+  return status;
+}
+
+// Make fd the target fd of a child, kept open over the exec.
+void child_dup(int fd, int target) {
+  if (fd == target) {
+    fcntl(fd, F_SETFD, 0);
+  } else {
+    dup2(fd, target);
+  }
+}
+
+/*
+ * vfork() and exec a pipeline stage at path. vfork() does not copy
+ * the page tables of the shell like fork() does: the child runs on
+ * the parent's memory, and the parent waits until the exec. So the
+ * child only does the fd plumbing and puts SIGPIPE back to default,
+ * the shell ignores it for its builtins. posix_spawn() did the same
+ * but reset every signal one by one, about 120 syscalls a command.
+ * Returns the pid, or -1 and errno of the failed exec.
+ */
+pid_t spawn_path(const char *path, cmd *command, int redirect_fd, int in_fd,
+                 int out_fd) {
+  const char *const *const_argv = (const char *const *)command->argv;
+  char *const *argv = (char *const *)const_argv;
+  // Shared with the child until the exec, it tells why the exec failed.
+  volatile int exec_errno = 0;
+  pid_t pid = vfork();
+  if (pid == 0) {
+    if (redirect_fd != -1) {
+      child_dup(redirect_fd, STDOUT_FILENO);
+    }
+    if (in_fd != -1) {
+      child_dup(in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+      child_dup(out_fd, STDOUT_FILENO);
+    }
+    signal(SIGPIPE, SIG_DFL);
+    execv(path, argv);
+    exec_errno = errno;
+    _exit(127);
+  }
+  if (pid == -1) {
+    return -1;
+  }
+  if (exec_errno != 0) {
+    waitpid(pid, NULL, 0);
+    errno = exec_errno;
+    return -1;
+  }
+  return pid;
+}
+
+/*
+ * Start a pipeline stage by the hashed path. The fds are the output
+ * redirect, then the pipe from the previous stage and the pipe to
+ * the next one, each fd is -1 if there is no such stage. The
+ * redirect file is opened here, so a failure to open it is told
+ * apart from a failure to exec. Returns the pid, or -1.
+ */
+pid_t spawn_command(cmd *command, int in_fd, int out_fd) {
+  int redirect_fd = -1;
+  if (command->redirect) {
+    redirect_fd = open_redirect(command);
+    if (redirect_fd == -1) {
+      return -1;
+    }
+  }
+
+  pid_t pid = -1;
+  const char *path = hash_lookup(command->name, true);
+  if (path != NULL) {
+    pid = spawn_path(path, command, redirect_fd, in_fd, out_fd);
+    if (pid == -1 && errno == ENOENT && path != command->name) {
+      // The command has moved, forget the old path and look again.
+      hash_remove(command->name);
+      path = hash_lookup(command->name, true);
+      if (path != NULL) {
+        pid = spawn_path(path, command, redirect_fd, in_fd, out_fd);
+      }
+    }
+  }
+  if (redirect_fd != -1) {
+    close(redirect_fd);
+  }
+  // A command which is not found fails silently, like a failed exec did.
+  return pid;
+}
+
+int main() {
+  bool eof = false;
+
+  // A builtin writing to a pipe with no reader gets EPIPE instead.
+  signal(SIGPIPE, SIG_IGN);
+
+  while (!eof) {
+    char cwd[1024];
+
+    int line_len = 0;
+    char *line = read_line(&line_len, &eof);
+
+    int commands_count = 0;
+    cmd **commands = parse_line(line, line_len, &commands_count);
+
+    int in_fd = -1;
+    int command_pids[commands_count];
+    // Builtins of the line and the pipes they write to, -1 if none.
+    const builtin *line_builtins[commands_count];
+    int builtin_fds[commands_count];
+
+    for (int i = 0; i < commands_count; i++) {
+      command_pids[i] = -1;
+      int fds[2] = {-1, -1};
+      if (i != commands_count - 1) {
+        make_pipe(fds);
+      }
+      line_builtins[i] = find_builtin(commands[i]->name, commands_count);
+      if (line_builtins[i] != NULL && line_builtins[i]->is_silent) {
+        // Nothing to read from it, the next stage gets EOF right away.
+        run_builtin(line_builtins[i], commands[i], fds[1]);
+        line_builtins[i] = NULL;
+      } else if (line_builtins[i] != NULL) {
+        builtin_fds[i] = fds[1];
+      } else {
+        command_pids[i] = spawn_command(commands[i], in_fd, fds[1]);
+        if (fds[1] != -1) {
+          close(fds[1]);
         }
       }
+      // A builtin does not read, its stdin is closed like a finished reader.
+      if (in_fd != -1) {
+        close(in_fd);
+      }
+      in_fd = fds[0];
     }
 
-    if (commands_count > 1) {
-      close(old_fds[0]);
-      close(old_fds[1]);
+    // The other builtins run when all the stages are started, so the next
+    // stage reads what a builtin writes and a full pipe does not block.
+    for (int i = 0; i < commands_count; i++) {
+      if (line_builtins[i] != NULL) {
+        run_builtin(line_builtins[i], commands[i], builtin_fds[i]);
+      }
     }
 
     for (int i = 0; i < commands_count; i++) {
       int status;
-      waitpid(command_pids[i], &status, 0);
+      if (command_pids[i] > 0) {
+        waitpid(command_pids[i], &status, 0);
+      }
     }
 
     free(line);